@@ -0,0 +1,119 @@
+// runs a single benchmark case in a fresh process and prints the result
+// as one line of JSON.  run.js forks one of these per case, so peak RSS
+// and heap state don't bleed from one case into the next.
+//
+//   node case.js diff <heap> <nodes>
+//   node --expose-gc case.js gc <loaded|unloaded> <gcs>
+
+const
+fs = require('fs'),
+heaps = require('./heaps');
+
+// setImmediate turns the loop, older nodes make do with a timer
+const defer = global.setImmediate || setTimeout;
+
+function ms(start) {
+  var d = process.hrtime(start);
+  return d[0] * 1e3 + d[1] / 1e6;
+}
+
+// the high water mark of RSS, where the platform tells us
+function peakRSS() {
+  try {
+    var m = /VmHWM:\s+(\d+) kB/.exec(fs.readFileSync('/proc/self/status', 'utf8'));
+    if (m) return parseInt(m[1], 10) * 1024;
+  } catch(e) { }
+  return process.memoryUsage().rss;
+}
+
+function report(result) {
+  result.peak_rss = peakRSS();
+  process.stdout.write(JSON.stringify(result) + '\n');
+}
+
+// snapshot and diff cost for a heap, synchronously and on the thread pool
+function diff(heap, nodes) {
+  var memwatch = require('..');
+  var result = { bench: 'diff', heap: heap, nodes: nodes };
+
+  var start = process.hrtime();
+  var keep = heaps[heap](nodes);
+  result.build_ms = ms(start);
+
+  // the first snapshot, and the second plus the comparison
+  start = process.hrtime();
+  var hd = new memwatch.HeapDiff();
+  result.snapshot_ms = ms(start);
+
+  // not every heap is an array (deep is a linked list), so hold them in one
+  var more = [heaps[heap](Math.max(1, Math.floor(nodes / 10)))];
+
+  start = process.hrtime();
+  var d = hd.end();
+  result.end_ms = ms(start);
+  result.heap_nodes = d.after.nodes;
+  result.allocated_nodes = d.change.allocated_nodes;
+
+  // endAsync blocks the loop only for the snapshot and copy.  a timer
+  // ticking every ms measures how late the loop runs while it works
+  hd = new memwatch.HeapDiff();
+  more.push(heaps[heap](1000));
+
+  var lag = 0, last = process.hrtime();
+  var ticker = setInterval(function() {
+    lag = Math.max(lag, ms(last) - 1);
+    last = process.hrtime();
+  }, 1);
+
+  start = process.hrtime();
+  hd.endAsync(function(err) {
+    result.async_total_ms = ms(start);
+    result.async_max_lag_ms = lag;
+    clearInterval(ticker);
+    if (err) result.error = err.message;
+    report(result);
+    keep = more = null;
+  });
+  result.async_block_ms = ms(start);
+}
+
+// what memwatch's gc hooks add to each collection.  both runs trigger
+// the same full gcs through --expose-gc; the loaded one also has a stats
+// listener, so the whole path down to javascript is exercised
+function gc(mode, gcs) {
+  if (typeof global.gc !== 'function') {
+    throw new Error('the gc benchmark needs --expose-gc');
+  }
+  var result = { bench: 'gc', mode: mode, gcs: gcs };
+  var events = 0;
+  if (mode === 'loaded') {
+    require('..').on('stats', function() { events++; });
+  }
+
+  var keep = heaps.small(100000);
+  global.gc();
+
+  var start = process.hrtime();
+  var i = 0;
+  (function next() {
+    // a turn of the loop between gcs, so stats are delivered as they
+    // would be in practice
+    if (i++ < gcs) {
+      global.gc();
+      return defer(next);
+    }
+    result.total_ms = ms(start);
+    result.per_gc_ms = result.total_ms / gcs;
+    result.stats_events = events;
+    report(result);
+    keep = null;
+  })();
+}
+
+var args = process.argv.slice(2);
+if (args[0] === 'diff') diff(args[1], parseInt(args[2], 10));
+else if (args[0] === 'gc') gc(args[1], parseInt(args[2], 10));
+else {
+  console.error('usage: case.js diff <heap> <nodes> | gc <loaded|unloaded> <gcs>');
+  process.exit(1);
+}
@@ -0,0 +1,46 @@
+// synthetic heaps of a given number of objects, each shaped to stress a
+// different part of diffing: wide fan out, deep chains, lots of small
+// objects with a few types, and few objects holding a lot of bytes.
+
+function Leaf(i) { this.i = i; }
+function Link(next) { this.next = next; }
+function Small(i) { this.a = i; this.b = null; }
+function Medium(i) { this.a = i; this.b = i + 1; this.c = null; }
+
+module.exports = {
+  // one array holding n leaves
+  wide: function(n) {
+    var arr = new Array(n);
+    for (var i = 0; i < n; i++) arr[i] = new Leaf(i);
+    return arr;
+  },
+
+  // a single linked list n long, the worst case for recursive walks
+  deep: function(n) {
+    var head = null;
+    for (var i = 0; i < n; i++) head = new Link(head);
+    return head;
+  },
+
+  // n small objects of two types, in chunks of 1000 so no one array
+  // dominates
+  small: function(n) {
+    var chunks = [], chunk;
+    for (var i = 0; i < n; i++) {
+      if (i % 1000 === 0) chunks.push(chunk = []);
+      chunk.push(i % 2 ? new Small(i) : new Medium(i));
+    }
+    return chunks;
+  },
+
+  // n / 1000 strings of 64kb each, so size outweighs count
+  strings: function(n) {
+    var out = [], count = Math.max(1, Math.floor(n / 1000));
+    var unit = new Array(1025).join('x');
+    for (var i = 0; i < count; i++) {
+      // distinct strings, or V8 would share one
+      out.push(i + new Array(65).join(unit));
+    }
+    return out;
+  }
+};
@@ -0,0 +1,89 @@
+// memwatch's benchmarks.  every case runs in a fresh node process and
+// reports one JSON object; the whole run is written out as a single JSON
+// document so that results can be kept and compared across revisions.
+//
+//   node bench/run.js [--sizes 10000,100000] [--heaps wide,deep]
+//                     [--gcs 50] [--out results.json]
+//
+// sizes default to 10k, 100k and 1M objects.  pass 10000000 in --sizes
+// for the 10M runs, given a few GB of memory and some patience.
+
+const
+fork = require('child_process').fork,
+fs = require('fs'),
+os = require('os'),
+path = require('path'),
+heaps = require('./heaps');
+
+var opts = {
+  sizes: [10000, 100000, 1000000],
+  heaps: Object.keys(heaps),
+  gcs: 50,
+  out: null
+};
+
+var argv = process.argv.slice(2);
+for (var i = 0; i < argv.length; i += 2) {
+  var k = argv[i].replace(/^--/, ''), v = argv[i + 1];
+  if (k === 'sizes') opts.sizes = v.split(',').map(Number);
+  else if (k === 'heaps') opts.heaps = v.split(',');
+  else if (k === 'gcs') opts.gcs = parseInt(v, 10);
+  else if (k === 'out') opts.out = v;
+  else {
+    console.error('unknown option: ' + argv[i]);
+    process.exit(1);
+  }
+}
+
+var cases = [];
+opts.heaps.forEach(function(heap) {
+  opts.sizes.forEach(function(nodes) {
+    cases.push(['diff', heap, String(nodes)]);
+  });
+});
+cases.push(['gc', 'unloaded', String(opts.gcs)]);
+cases.push(['gc', 'loaded', String(opts.gcs)]);
+
+function runCase(args, cb) {
+  var execArgv = ['--expose-gc'];
+  // big heaps outgrow V8's default limit
+  if (args[0] === 'diff' && parseInt(args[2], 10) >= 1000000) {
+    execArgv.push('--max_old_space_size=8192');
+  }
+  var out = '';
+  var child = fork(path.join(__dirname, 'case.js'), args,
+                   { silent: true, execArgv: execArgv });
+  child.stdout.on('data', function(d) { out += d; });
+  child.stderr.pipe(process.stderr);
+  child.on('exit', function(code) {
+    var result;
+    try { result = JSON.parse(out); }
+    catch(e) { result = { bench: args[0], args: args.slice(1), error: 'exited with ' + code }; }
+    cb(result);
+  });
+}
+
+var results = [];
+(function next() {
+  var args = cases.shift();
+  if (!args) return done();
+  console.error('bench: ' + args.join(' '));
+  runCase(args, function(result) {
+    results.push(result);
+    next();
+  });
+})();
+
+function done() {
+  var report = {
+    memwatch: require('../package.json').version,
+    node: process.version,
+    platform: process.platform + '-' + process.arch,
+    cpus: os.cpus().length,
+    time: new Date().toISOString(),
+    results: results
+  };
+  var json = JSON.stringify(report, null, 2) + '\n';
+  if (opts.out) fs.writeFileSync(opts.out, json);
+  else process.stdout.write(json);
+}
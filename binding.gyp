@@ -3,13 +3,48 @@
     {
       'target_name': 'memwatch',
       'include_dirs': [
+        '<(node_root_dir)/deps/zlib'
       ],
       'sources': [
+        'src/census.cc',
+        'src/changeset.cc',
+        'src/dominators.cc',
+        'src/gcstats.cc',
         'src/heapdiff.cc',
+        'src/heapdiffsession.cc',
+        'src/heaphistory.cc',
         'src/init.cc',
+        'src/instance.cc',
+        'src/leakdetector.cc',
         'src/memwatch.cc',
+        'src/nativemem.cc',
+        'src/objecttracker.cc',
+        'src/parallel.cc',
+        'src/retainerpaths.cc',
+        'src/snapshotcopy.cc',
+        'src/snapshotfile.cc',
+        'src/snapshotindex.cc',
+        'src/snapshotwriter.cc',
         'src/util.cc'
       ],
+    },
+    {
+      # compares two snapshots written with writeSnapshot(path, { binary: true })
+      'target_name': 'memwatch-diff',
+      'type': 'executable',
+      'sources': [
+        'src/changeset.cc',
+        'src/dominators.cc',
+        'src/parallel.cc',
+        'src/retainerpaths.cc',
+        'src/snapshotfile.cc',
+        'src/snapshotindex.cc',
+        'src/util.cc',
+        'tools/memwatch-diff.cc'
+      ],
+      'conditions': [
+        ['OS!="win"', { 'libraries': [ '-lpthread' ] }]
+      ],
     }
   ]
 }
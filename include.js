@@ -1,16 +1,90 @@
 const
 magic = require('./build/Release/memwatch'),
-events = require('events');
+events = require('events'),
+util = require('util');
 
-module.exports = new events.EventEmitter();
+// an event emitter that keeps the native side informed of whether
+// anyone is listening, so events nobody hears are never built and
+// javascript isn't called on their account
+function Memwatch() {
+  events.EventEmitter.call(this);
+}
+util.inherits(Memwatch, events.EventEmitter);
+
+['addListener', 'on', 'once', 'prependListener', 'prependOnceListener',
+ 'removeListener', 'off', 'removeAllListeners'].forEach(function(name) {
+  const method = events.EventEmitter.prototype[name];
+  if (typeof method !== 'function') return;
+  Memwatch.prototype[name] = function() {
+    var r = method.apply(this, arguments);
+    magic.set_listeners(this.listeners('stats').length > 0,
+                        this.listeners('leak').length > 0);
+    return r;
+  };
+});
+
+module.exports = new Memwatch();
 
 module.exports.gc = magic.gc;
+module.exports.gcStats = magic.gc_stats;
+module.exports.heapStats = magic.heap_stats;
+module.exports.processStats = magic.process_stats;
+module.exports.configureLeakDetector = magic.configure_leak_detector;
+module.exports.configureStats = magic.configure_stats;
+module.exports.setSampling = magic.set_sampling;
+module.exports.census = magic.census;
+module.exports.setCensusInterval = magic.set_census_interval;
 module.exports.HeapDiff = magic.HeapDiff;
+module.exports.HeapDiffSession = magic.HeapDiffSession;
+// for tests, see src/heapdiff.hh
+module.exports._forceParallel = magic.force_parallel;
+// for tests, see src/memwatch.hh
+module.exports._simulateLeakDetector = magic.simulate_leak_detector;
+
+// async methods take a node style callback natively, wrap them to hand
+// back a promise when there's no callback
+function promising(proto, name) {
+  const method = proto[name];
+  proto[name] = function(cb) {
+    if (typeof cb === 'function' || typeof Promise !== 'function') {
+      return method.call(this, cb);
+    }
+    var self = this;
+    return new Promise(function(resolve, reject) {
+      method.call(self, function(err, diff) {
+        if (err) reject(err);
+        else resolve(diff);
+      });
+    });
+  };
+}
+promising(magic.HeapDiff.prototype, 'endAsync');
+promising(magic.HeapDiffSession.prototype, 'checkpointAsync');
 
-magic.upon_gc(function(has_listeners, event, data) {
-  if (has_listeners) {
-    return (module.exports.listeners('stats').length > 0);
-  } else {
-    return module.exports.emit(event, data);
+// writeSnapshot(path, [{ gzip: true }], [cb]) streams a heap snapshot that
+// devtools can load to path, cb(err, bytesWritten).  { binary: true }
+// writes memwatch's compact format instead, for the memwatch-diff tool
+module.exports.writeSnapshot = function(path, opts, cb) {
+  if (typeof opts === 'function') {
+    cb = opts;
+    opts = {};
   }
+  opts = opts || {};
+  function write(done) {
+    if (opts.binary) magic.write_binary_snapshot(path, done);
+    else magic.write_snapshot(path, !!opts.gzip, done);
+  }
+  if (typeof cb !== 'function' && typeof Promise === 'function') {
+    return new Promise(function(resolve, reject) {
+      write(function(err, bytes) {
+        if (err) reject(err);
+        else resolve(bytes);
+      });
+    });
+  }
+  write(cb || function() {});
+};
+
+magic.upon_gc(function(event, data) {
+  return module.exports.emit(event, data);
 });
@@ -0,0 +1,269 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "census.hh"
+#include "changeset.hh"
+#include "heapdiff.hh"
+#include "instance.hh"
+#include "snapshotcopy.hh"
+
+#include <v8-profiler.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace v8;
+using namespace std;
+
+// how many growing types a leak report lists
+static const size_t TOP_TYPES = 10;
+
+static census::State & state()
+{
+    return memwatch::Instance::current()->census;
+}
+
+static void take(census::Census & c, unsigned int compaction)
+{
+    HandleScope scope;
+
+    heapdiff::State & diff = memwatch::Instance::current()->diff;
+
+    c.counts.assign(c.counts.size(), 0);
+    c.sizes.assign(c.sizes.size(), 0);
+    c.nodes = 0;
+    c.size = 0;
+
+    // each node goes straight into its type's totals, nothing is kept
+    // per node
+    const HeapSnapshot * snapshot = heapdiff::HeapDiff::TakeSnapshot();
+    int count = snapshot->GetNodesCount();
+    for (int i = 0; i < count; i++) {
+        HandleScope scope;
+        const HeapGraphNode * n = snapshot->GetNode(i);
+
+        uint32_t type = n->GetType();
+        uint32_t name = snapshotindex::NameTable::NO_NAME;
+        if (type == snapshotindex::kObject) {
+            name = snapshotindex::internName(n->GetName(), diff.names);
+        } else if (type == snapshotindex::kHidden || type >= snapshotindex::kSynthetic) {
+            continue;
+        }
+        uint32_t key = heapdiff::typeKey(type, name);
+
+        if (key >= c.counts.size()) {
+            c.counts.resize(key + 1, 0);
+            c.sizes.resize(key + 1, 0);
+        }
+        int size = n->GetSelfSize();
+        c.counts[key]++;
+        c.sizes[key] += size;
+        c.nodes++;
+        c.size += size;
+    }
+    ((HeapSnapshot *) snapshot)->Delete();
+
+    c.valid = true;
+    c.time = time(NULL);
+    c.compaction = compaction;
+}
+
+void census::sample(unsigned int compaction)
+{
+    State & self = state();
+    if (!self.every || compaction % self.every) return;
+    // a leak report at this compaction has just taken one
+    if (self.latest.valid && self.latest.compaction == compaction) return;
+    take(self.latest, compaction);
+}
+
+void census::growth_started()
+{
+    State & self = state();
+    if (!self.every) return;
+    self.start = self.latest;
+}
+
+struct ByGrowth
+{
+    const census::Census & a;
+    const census::Census & b;
+    ByGrowth(const census::Census & a, const census::Census & b) : a(a), b(b) { }
+    int64_t growth(uint32_t key) const {
+        uint32_t before = key < a.counts.size() ? a.counts[key] : 0;
+        return (int64_t) b.counts[key] - (int64_t) before;
+    }
+    int64_t sizeGrowth(uint32_t key) const {
+        int64_t before = key < a.sizes.size() ? a.sizes[key] : 0;
+        return b.sizes[key] - before;
+    }
+    bool operator()(uint32_t x, uint32_t y) const {
+        return growth(x) > growth(y);
+    }
+};
+
+Handle<Value> census::growing_types(unsigned int compaction)
+{
+    State & self = state();
+    if (!self.every || !self.start.valid) return Handle<Value>();
+
+    HandleScope scope;
+
+    take(self.latest, compaction);
+    const Census & a = self.start;
+    const Census & b = self.latest;
+    const snapshotindex::NameTable & names = heapdiff::sharedNames();
+
+    // named types only, never hidden or synthetic nodes.  arrays count
+    // as Array, as they do in diffs
+    vector<uint32_t> grew;
+    ByGrowth byGrowth(a, b);
+    for (uint32_t key = snapshotindex::kSynthetic + 1; key < b.counts.size(); key++) {
+        if (byGrowth.growth(key) > 0) grew.push_back(key);
+    }
+    size_t n = min(grew.size(), TOP_TYPES);
+    partial_sort(grew.begin(), grew.begin() + n, grew.end(), byGrowth);
+
+    unsigned int gcs = b.compaction > a.compaction ? b.compaction - a.compaction : 1;
+
+    Local<Array> types = Array::New(n);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t key = grew[i];
+        Local<Object> t = Object::New();
+        t->Set(String::New("what"), String::New(heapdiff::typeKeyName(key, names)));
+        t->Set(String::New("+"), Number::New((double) byGrowth.growth(key)));
+        t->Set(String::New("size_bytes"), Number::New((double) byGrowth.sizeGrowth(key)));
+        t->Set(String::New("per_gc"),
+               Number::New((double) byGrowth.growth(key) / gcs));
+        types->Set(i, t);
+    }
+
+    return scope.Close(types);
+}
+
+Handle<Value> census::set_sampling(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+        return ThrowException(Exception::TypeError(
+            String::New("setSampling takes a number of compactions, 0 to stop")));
+    }
+
+    if (!memwatch::Instance::current()) return memwatch::Instance::missing();
+
+    State & self = state();
+    self.every = args[0]->Uint32Value();
+    if (!self.every) {
+        self.latest.valid = false;
+        self.start.valid = false;
+    }
+
+    return scope.Close(Undefined());
+}
+
+struct BySize
+{
+    const census::Census & c;
+    BySize(const census::Census & c) : c(c) { }
+    bool operator()(uint32_t x, uint32_t y) const {
+        return c.sizes[x] > c.sizes[y];
+    }
+};
+
+// { time, nodes, size_bytes, types: [ { what, type_id, count, size_bytes } ] }
+// with every type that has a live node, largest first
+static Handle<Value> censusToObject(const census::Census & c)
+{
+    HandleScope scope;
+
+    const snapshotindex::NameTable & names = heapdiff::sharedNames();
+    heapdiff::Keys & key = memwatch::Instance::current()->diff.keys;
+
+    vector<uint32_t> live;
+    for (uint32_t k = 0; k < c.counts.size(); k++) {
+        if (c.counts[k] && heapdiff::typeKeyName(k, names)) live.push_back(k);
+    }
+    sort(live.begin(), live.end(), BySize(c));
+
+    Local<Array> types = Array::New(live.size());
+    for (size_t i = 0; i < live.size(); i++) {
+        uint32_t k = live[i];
+        Local<Object> t = Object::New();
+        t->Set(key.what, String::New(heapdiff::typeKeyName(k, names)));
+        t->Set(key.type_id, Integer::NewFromUnsigned(k));
+        t->Set(key.count, Number::New((double) c.counts[k]));
+        t->Set(key.size_bytes, Number::New((double) c.sizes[k]));
+        types->Set(i, t);
+    }
+
+    Local<Object> o = Object::New();
+    o->Set(key.time, NODE_UNIXTIME_V8(c.time));
+    o->Set(key.nodes, Number::New((double) c.nodes));
+    o->Set(key.size_bytes, Number::New((double) c.size));
+    o->Set(String::NewSymbol("types"), types);
+
+    return scope.Close(o);
+}
+
+Handle<Value> census::take_census(const Arguments& args)
+{
+    HandleScope scope;
+
+    memwatch::Instance * instance = memwatch::Instance::current();
+    if (!instance) return memwatch::Instance::missing();
+
+    Census c;
+    take(c, instance->watch.stats.gc_compact);
+    return scope.Close(censusToObject(c));
+}
+
+static void AsyncCensusTimer(uv_timer_t * handle, int)
+{
+    HandleScope scope;
+
+    memwatch::Instance & instance = *(memwatch::Instance *) handle->data;
+    memwatch::State & st = instance.watch;
+    if (st.cb.IsEmpty()) return;
+
+    census::Census c;
+    take(c, st.stats.gc_compact);
+
+    Handle<Value> argv[2];
+    argv[0] = String::NewSymbol("census");
+    argv[1] = censusToObject(c);
+    st.cb->Call(st.context, 2, argv);
+}
+
+Handle<Value> census::set_census_interval(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+        return ThrowException(Exception::TypeError(
+            String::New("setCensusInterval takes a number of milliseconds, 0 to stop")));
+    }
+
+    memwatch::Instance * instance = memwatch::Instance::current();
+    if (!instance) return memwatch::Instance::missing();
+    if (!instance->loop) return memwatch::Instance::offLoop("setCensusInterval");
+
+    State & self = instance->census;
+    self.interval = (uint64_t) args[0]->IntegerValue();
+
+    if (!self.timerInit) {
+        uv_timer_init(instance->loop, &self.timer);
+        self.timer.data = instance;
+        self.timerInit = true;
+    }
+
+    uv_timer_stop(&self.timer);
+    if (self.interval) {
+        uv_timer_start(&self.timer, AsyncCensusTimer, self.interval, self.interval);
+        // a census on a timer shouldn't keep the process alive
+        uv_unref((uv_handle_t *) &self.timer);
+    }
+
+    return scope.Close(Undefined());
+}
@@ -0,0 +1,79 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __CENSUS_HH
+#define __CENSUS_HH
+
+#include <node.h>
+
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+// a cheap answer to "what's on the heap?".  live objects are counted per
+// type into a table, keyed as heap diffs key them.  no graph is copied,
+// sorted or diffed and no edge is looked at; the snapshot is walked once
+// and thrown away.  leak reports compare two of these to say what grew,
+// and javascript can take them on demand or on a timer.
+namespace census
+{
+    struct Census
+    {
+        Census() : valid(false), time(0), compaction(0), nodes(0), size(0) { }
+
+        bool valid;
+        time_t time;
+        unsigned int compaction;
+        int64_t nodes;
+        int64_t size;
+        // live nodes and their self size, indexed by type key
+        // (heapdiff::typeKey()), in the isolate's name table
+        std::vector<uint32_t> counts;
+        std::vector<int64_t> sizes;
+    };
+
+    // one isolate's censuses
+    struct State
+    {
+        State() : every(0), interval(0), timerInit(false) { }
+
+        // 0 when sampling is off
+        unsigned int every;
+        // the most recent census, and the one taken before growth began
+        Census latest;
+        Census start;
+
+        // milliseconds between census events, 0 when they're off
+        uint64_t interval;
+        bool timerInit;
+        uv_timer_t timer;
+    };
+
+    // called at every compaction, from the event loop, takes a census
+    // when one is due
+    void sample(unsigned int compaction);
+
+    // heap growth began at this compaction, the last census taken becomes
+    // what we compare against when growth turns into a leak
+    void growth_started();
+
+    // take a fresh census and report the constructors whose instance count
+    // grew most since growth started, as an array of { what, +, size_bytes,
+    // per_gc }.  an empty handle if sampling is off or there's nothing to
+    // compare against
+    v8::Handle<v8::Value> growing_types(unsigned int compaction);
+
+    // memwatch.setSampling(n) takes a census every n compactions, 0 stops
+    v8::Handle<v8::Value> set_sampling(const v8::Arguments& args);
+
+    // memwatch.census() takes one now
+    v8::Handle<v8::Value> take_census(const v8::Arguments& args);
+
+    // memwatch.setCensusInterval(ms) emits a census event every ms
+    // milliseconds, 0 stops
+    v8::Handle<v8::Value> set_census_interval(const v8::Arguments& args);
+};
+
+#endif
@@ -0,0 +1,547 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "changeset.hh"
+#include "dominators.hh"
+#include "parallel.hh"
+#include "retainerpaths.hh"
+
+#include <stdio.h>  // snprintf()
+#include <string.h> // memcmp(), strcmp()
+
+using namespace std;
+using namespace snapshotindex;
+
+const char *
+heapdiff::typeKeyName(uint32_t key, const NameTable & names)
+{
+    if (key > kSynthetic) return names.name(key - kSynthetic - 1).c_str();
+    return NULL;
+}
+
+struct ByName
+{
+    const NameTable & names;
+    ByName(const NameTable & n) : names(n) { }
+    bool operator()(uint32_t a, uint32_t b) const {
+        return strcmp(heapdiff::typeKeyName(a, names),
+                      heapdiff::typeKeyName(b, names)) < 0;
+    }
+};
+
+void
+heapdiff::reportOrder(const changeset & changes, const NameTable & names,
+                      vector<uint32_t> & keys)
+{
+    keys.clear();
+    for (uint32_t k = 0; k < changes.size(); k++) {
+        if ((changes[k].added || changes[k].released) && typeKeyName(k, names)) {
+            keys.push_back(k);
+        }
+    }
+    sort(keys.begin(), keys.end(), ByName(names));
+}
+
+static inline void manageChange(heapdiff::changeset & changes, uint32_t key,
+                                int size, bool added)
+{
+    heapdiff::change & c = changes[key];
+
+    c.size += size * (added ? 1 : -1);
+    if (added) c.added++;
+    else c.released++;
+}
+
+static bool
+retainsMore(const DominatorTree & dom, uint32_t a, uint32_t b)
+{
+    return dom.retainedSize(a) > dom.retainedSize(b);
+}
+
+// fill in retained sizes and the largest examples of each allocated type.
+// a type's retained size is the sum over its new instances that aren't
+// themselves dominated by another new instance of the same type, so
+// nothing is counted twice.
+static void computeRetained(const Graph & after, const NameTable & names,
+                            const vector<uint32_t> & allocated,
+                            unsigned int maxExamples,
+                            heapdiff::changeset & changes)
+{
+    DominatorTree dom(after);
+
+    vector<bool> isNew(after.nodeCount(), false);
+    for (size_t i = 0; i < allocated.size(); i++) isNew[allocated[i]] = true;
+
+    size_t keys = heapdiff::typeKeyCount(names);
+    vector<int64_t> retained(keys, 0);
+    vector<uint32_t> active(keys, 0);
+    vector<vector<uint32_t> > top(keys);
+
+    // the new nodes whose dominator subtree we're currently inside of, as
+    // (end of subtree, type key)
+    vector<pair<uint32_t, uint32_t> > open;
+
+    const vector<uint32_t> & pre = dom.preorder();
+    for (uint32_t i = 0; i < pre.size(); i++) {
+        while (!open.empty() && open.back().first <= i) {
+            active[open.back().second]--;
+            open.pop_back();
+        }
+
+        uint32_t pos = pre[i];
+        if (!isNew[pos]) continue;
+
+        uint32_t key = heapdiff::typeKey(after, pos);
+        if (!active[key]) retained[key] += dom.retainedSize(pos);
+        active[key]++;
+        open.push_back(make_pair(dom.subtreeEnd(i), key));
+
+        // keep the largest few of each type, sorted
+        vector<uint32_t> & t = top[key];
+        if (t.size() < maxExamples || (maxExamples && retainsMore(dom, pos, t.back()))) {
+            if (t.size() == maxExamples) t.pop_back();
+            size_t j = t.size();
+            t.push_back(pos);
+            while (j > 0 && retainsMore(dom, t[j], t[j - 1])) {
+                swap(t[j], t[j - 1]);
+                j--;
+            }
+        }
+    }
+
+    for (size_t key = 0; key < keys; key++) {
+        const char * type = heapdiff::typeKeyName(key, names);
+        if (!type) continue;
+
+        heapdiff::change & c = changes[key];
+        c.retained += retained[key];
+        for (size_t j = 0; j < top[key].size(); j++) {
+            uint32_t pos = top[key][j];
+            heapdiff::example e;
+            e.type = after.types[pos];
+            e.name = type;
+            e.self_size = after.sizes[pos];
+            e.retained_size = dom.retainedSize(pos);
+            e.retainers = dom.retainers(pos);
+            c.examples.push_back(e);
+        }
+    }
+}
+
+// how many new instances of each type get a retainer path, and how many
+// steps of a path (nearest the instance) we keep
+static const size_t PATH_SAMPLES = 3;
+static const size_t PATH_STEPS = 32;
+
+static string nodeName(const Graph & g, const NameTable & names, uint32_t pos)
+{
+    if (g.types[pos] == kObject && g.names[pos] != NameTable::NO_NAME) {
+        return names.name(g.names[pos]);
+    }
+    uint32_t type = NameTable::typeName(g.types[pos]);
+    if (type != NameTable::NO_NAME) return names.name(type);
+    // synthetic nodes like (GC roots) are typed hidden, but named
+    if (g.names[pos] != NameTable::NO_NAME) return g.labels.name(g.names[pos]);
+    return "(hidden)";
+}
+
+static string edgeName(const Graph & g, uint32_t e)
+{
+    if (g.edgeNames.empty()) return "";
+
+    uint32_t name = g.edgeNames[e];
+    if (g.edgeTypes[e] == kElement || g.edgeTypes[e] == kHiddenEdge) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "[%u]", name);
+        return buf;
+    }
+    return name == NameTable::NO_NAME ? "" : g.labels.name(name);
+}
+
+struct ByAdded
+{
+    const heapdiff::changeset & changes;
+    ByAdded(const heapdiff::changeset & c) : changes(c) { }
+    bool operator()(uint32_t a, uint32_t b) const {
+        return changes[a].added > changes[b].added;
+    }
+};
+
+// shortest retainer paths to a few new instances of each of the types
+// that grew the most.  one breadth first search covers them all.
+static void computePaths(const Graph & after, const NameTable & names,
+                         const vector<uint32_t> & allocated,
+                         unsigned int maxTypes,
+                         heapdiff::changeset & changes)
+{
+    vector<uint32_t> keys;
+    for (uint32_t k = 0; k < changes.size(); k++) {
+        if (changes[k].added && heapdiff::typeKeyName(k, names)) keys.push_back(k);
+    }
+    size_t n = min(keys.size(), (size_t) maxTypes);
+    partial_sort(keys.begin(), keys.begin() + n, keys.end(), ByAdded(changes));
+
+    vector<size_t> wanted(changes.size(), 0);
+    for (size_t i = 0; i < n; i++) wanted[keys[i]] = PATH_SAMPLES;
+
+    vector<uint32_t> samples;
+    for (size_t i = 0; i < allocated.size(); i++) {
+        uint32_t key = heapdiff::typeKey(after, allocated[i]);
+        if (wanted[key]) {
+            wanted[key]--;
+            samples.push_back(allocated[i]);
+        }
+    }
+
+    ShortestPaths sp(after, samples);
+
+    vector<uint32_t> edges;
+    for (size_t i = 0; i < samples.size(); i++) {
+        sp.path(samples[i], edges);
+        if (edges.empty()) continue;
+
+        heapdiff::RetainerPath path;
+        heapdiff::PathStep step;
+        size_t first = 0;
+        if (edges.size() > PATH_STEPS) {
+            // elide the far end, it's the near end that tells the story
+            first = edges.size() - PATH_STEPS;
+            step.what = "...";
+        } else {
+            step.what = nodeName(after, names, after.root);
+        }
+        path.push_back(step);
+
+        for (size_t j = first; j < edges.size(); j++) {
+            step.edge = edgeName(after, edges[j]);
+            step.what = nodeName(after, names, after.edges[edges[j]]);
+            path.push_back(step);
+        }
+        changes[heapdiff::typeKey(after, samples[i])].paths.push_back(path);
+    }
+}
+
+struct ByWasted
+{
+    const vector<heapdiff::StringGroup> & groups;
+    ByWasted(const vector<heapdiff::StringGroup> & g) : groups(g) { }
+    bool operator()(uint32_t a, uint32_t b) const {
+        return groups[a].wasted > groups[b].wasted;
+    }
+};
+
+// group the new strings whose contents were copied by those contents (up
+// to the prefix copied), and keep the groups that waste the most.  the
+// table is sized to the new strings, not to the heap.
+static void groupStrings(const Graph & after, const vector<uint32_t> & allocated,
+                         unsigned int maxGroups,
+                         vector<heapdiff::StringGroup> & result)
+{
+    const StringContents & s = after.strings;
+
+    vector<uint32_t> copied;
+    for (size_t i = 0; i < allocated.size(); i++) {
+        size_t index;
+        if (after.types[allocated[i]] == kString && s.find(allocated[i], index)) {
+            copied.push_back(index);
+        }
+    }
+
+    size_t cap = 16;
+    while (cap < copied.size() * 2) cap <<= 1;
+    size_t mask = cap - 1;
+
+    static const uint32_t EMPTY = 0xffffffff;
+    vector<uint32_t> slots(cap, EMPTY);
+    // per group, its hash and the string that stands for it
+    vector<uint32_t> hashes;
+    vector<uint32_t> firsts;
+    vector<heapdiff::StringGroup> groups;
+
+    for (size_t i = 0; i < copied.size(); i++) {
+        uint32_t index = copied[i];
+        uint32_t h = hashBytes(s.data(index), s.copied(index));
+
+        size_t slot = h & mask;
+        while (slots[slot] != EMPTY) {
+            uint32_t g = slots[slot];
+            uint32_t f = firsts[g];
+            if (hashes[g] == h && s.copied(f) == s.copied(index) &&
+                s.truncated(f) == s.truncated(index) &&
+                !memcmp(s.data(f), s.data(index), s.copied(index)))
+            {
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+
+        int size = after.sizes[s.pos[index]];
+        if (slots[slot] == EMPTY) {
+            slots[slot] = groups.size();
+            hashes.push_back(h);
+            firsts.push_back(index);
+
+            heapdiff::StringGroup g;
+            g.prefix = s.truncated(index);
+            g.count = 0;
+            g.size = 0;
+            g.wasted = -size;
+            groups.push_back(g);
+        }
+
+        heapdiff::StringGroup & g = groups[slots[slot]];
+        g.count++;
+        g.size += size;
+        g.wasted += size;
+    }
+
+    vector<uint32_t> dups;
+    for (uint32_t g = 0; g < groups.size(); g++) {
+        if (groups[g].count > 1) dups.push_back(g);
+    }
+    size_t n = min(dups.size(), (size_t) maxGroups);
+    partial_sort(dups.begin(), dups.begin() + n, dups.end(), ByWasted(groups));
+
+    result.clear();
+    for (size_t i = 0; i < n; i++) {
+        uint32_t f = firsts[dups[i]];
+        result.push_back(groups[dups[i]]);
+        result.back().value.assign(s.data(f), s.copied(f));
+    }
+}
+
+static void appendNode(heapdiff::Baseline & b, const Graph & g, uint32_t pos)
+{
+    b.ids.push_back(g.ids[pos]);
+    b.keys.push_back(heapdiff::typeKey(g, pos));
+    b.sizes.push_back(g.sizes[pos]);
+}
+
+// what one slice of a merge found of a type
+struct Tally
+{
+    int64_t size;
+    int64_t added;
+    int64_t released;
+};
+
+static bool entryBefore(const Entry & e, uint64_t id)
+{
+    return e.id < id;
+}
+
+// the linear merge of a baseline against a later index, split by id range.
+// slice p covers entries [p/n, (p+1)/n) of the longer of the two lists,
+// and of the other whatever falls between the same ids, so every id falls
+// in exactly one slice (and an empty list is never split).  each slice
+// tallies into a table of its own, summed once they're done.
+class Merge : public parallel::Job
+{
+  public:
+    Merge(const heapdiff::BaselineView & before, const SnapshotIndex & index,
+          size_t keys, heapdiff::Baseline * next, unsigned int parts)
+        : before(before), after(index.graph()), ea(index.entries()),
+          next(next), parts(parts), starts(parts + 1), firsts(parts + 1),
+          tallies(parts), allocated(parts), freed(parts, 0)
+    {
+        bool byBefore = before.count > ea.size();
+        for (unsigned int p = 0; p <= parts; p++) {
+            if (p == 0) {
+                starts[p] = firsts[p] = 0;
+            } else if (p == parts) {
+                starts[p] = ea.size();
+                firsts[p] = before.count;
+            } else if (byBefore) {
+                firsts[p] = parallel::begin(before.count, p, parts);
+                starts[p] = lower_bound(ea.begin(), ea.end(), before.ids[firsts[p]],
+                                        entryBefore) - ea.begin();
+            } else {
+                starts[p] = parallel::begin(ea.size(), p, parts);
+                firsts[p] = lower_bound(before.ids, before.ids + before.count,
+                                        ea[starts[p]].id) - before.ids;
+            }
+        }
+
+        Tally zero = { 0, 0, 0 };
+        for (unsigned int p = 0; p < parts; p++) tallies[p].assign(keys, zero);
+    }
+
+    void run(unsigned int part) {
+        vector<Tally> & t = tallies[part];
+        size_t i = firsts[part], iEnd = firsts[part + 1];
+        size_t j = starts[part], jEnd = starts[part + 1];
+
+        while (i < iEnd || j < jEnd) {
+            if (j == jEnd || (i < iEnd && before.ids[i] < ea[j].id)) {
+                Tally & c = t[before.keys[i]];
+                c.size -= before.sizes[i];
+                c.released++;
+                freed[part]++;
+                i++;
+                continue;
+            }
+
+            uint32_t pos = ea[j].pos;
+            uint32_t key = heapdiff::typeKey(after, pos);
+            if (i == iEnd || ea[j].id < before.ids[i]) {
+                Tally & c = t[key];
+                c.size += after.sizes[pos];
+                c.added++;
+                allocated[part].push_back(pos);
+            } else {
+                i++;
+            }
+            if (next) {
+                next->ids[j] = after.ids[pos];
+                next->keys[j] = key;
+                next->sizes[j] = after.sizes[pos];
+            }
+            j++;
+        }
+    }
+
+    const heapdiff::BaselineView & before;
+    const Graph & after;
+    const vector<Entry> & ea;
+    heapdiff::Baseline * next;
+    unsigned int parts;
+
+    vector<size_t> starts;
+    vector<size_t> firsts;
+    vector<vector<Tally> > tallies;
+    vector<vector<uint32_t> > allocated;
+    vector<size_t> freed;
+};
+
+void
+heapdiff::summarize(const Graph & g, Baseline & b, const Filter * filter,
+                    unsigned int threads)
+{
+    SnapshotIndex index(g, filter, threads);
+    const vector<Entry> & entries = index.entries();
+
+    b.summary.nodes = index.nodes();
+    b.summary.size = index.size();
+    b.ids.clear();
+    b.keys.clear();
+    b.sizes.clear();
+    b.ids.reserve(entries.size());
+    b.keys.reserve(entries.size());
+    b.sizes.reserve(entries.size());
+
+    for (size_t i = 0; i < entries.size(); i++) appendNode(b, g, entries[i].pos);
+}
+
+void
+heapdiff::compare(const Graph & before, const Graph & after,
+                  const NameTable & names, const DiffOptions & options,
+                  Comparison & result)
+{
+    Filter filter = options.filter;
+    filter.prepare(names);
+
+    Baseline b;
+    summarize(before, b, &filter, options.threads);
+    b.summary.time = result.before.time;
+
+    compare(b, after, names, options, result);
+}
+
+void
+heapdiff::compare(const BaselineView & before, const Graph & after,
+                  const NameTable & names, const DiffOptions & options,
+                  Comparison & result, Baseline * next)
+{
+    Filter filter = options.filter;
+    filter.prepare(names);
+
+    // now let's get allocations by name
+    SnapshotIndex afterIndex(after, &filter, options.threads);
+    const vector<Entry> & ea = afterIndex.entries();
+
+    result.before = before.summary;
+    result.after.nodes = afterIndex.nodes();
+    result.after.size = afterIndex.size();
+    result.sizeChange = result.after.size - result.before.size;
+
+    if (next) {
+        next->summary = result.after;
+        next->ids.resize(ea.size());
+        next->keys.resize(ea.size());
+        next->sizes.resize(ea.size());
+    }
+
+    // before - after will reveal nodes released (memory freed),
+    // after - before will reveal nodes added (memory allocated).  one
+    // linear merge of the two sorted id lists finds both.
+    size_t keys = heapdiff::typeKeyCount(names);
+    unsigned int parts = parallel::partsFor(before.count + ea.size(),
+                                            options.threads);
+    Merge merge(before, afterIndex, keys, next, parts);
+    parallel::run(merge, parts);
+
+    result.changes.assign(keys, heapdiff::change());
+    result.freedNodes = 0;
+    vector<uint32_t> allocated;
+    for (unsigned int p = 0; p < parts; p++) {
+        for (size_t k = 0; k < keys; k++) {
+            const Tally & t = merge.tallies[p][k];
+            heapdiff::change & c = result.changes[k];
+            c.size += t.size;
+            c.added += t.added;
+            c.released += t.released;
+        }
+        result.freedNodes += merge.freed[p];
+        // slices are in id order, so this is too
+        allocated.insert(allocated.end(), merge.allocated[p].begin(),
+                         merge.allocated[p].end());
+    }
+    result.allocatedNodes = allocated.size();
+
+    if (options.retained) {
+        computeRetained(after, names, allocated, options.examples,
+                        result.changes);
+    }
+    if (options.paths) {
+        computePaths(after, names, allocated, options.paths, result.changes);
+    }
+    if (options.strings) {
+        groupStrings(after, allocated, options.strings, result.strings);
+    }
+}
+
+void
+heapdiff::compareSince(uint64_t since, const Graph & after,
+                       const NameTable & names, const DiffOptions & options,
+                       Comparison & result)
+{
+    Filter filter = options.filter;
+    filter.prepare(names);
+
+    SnapshotIndex afterIndex(after, &filter, options.threads);
+
+    result.changes.assign(heapdiff::typeKeyCount(names), heapdiff::change());
+
+    // entries are sorted by id, the new nodes are a suffix
+    vector<uint32_t> allocated;
+    const vector<Entry> & ea = afterIndex.entries();
+    for (size_t j = ea.size(); j > 0 && ea[j - 1].id > since; j--) {
+        uint32_t pos = ea[j - 1].pos;
+        manageChange(result.changes, heapdiff::typeKey(after, pos),
+                     after.sizes[pos], true);
+        allocated.push_back(pos);
+    }
+    result.allocatedNodes = allocated.size();
+
+    if (options.retained) {
+        computeRetained(after, names, allocated, options.examples,
+                        result.changes);
+    }
+    if (options.paths) {
+        computePaths(after, names, allocated, options.paths, result.changes);
+    }
+    if (options.strings) {
+        groupStrings(after, allocated, options.strings, result.strings);
+    }
+}
@@ -0,0 +1,224 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __CHANGESET_HH
+#define __CHANGESET_HH
+
+#include "snapshotindex.hh"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+namespace heapdiff
+{
+    class example
+    {
+    public:
+        int context;
+        int type;
+        std::string name;
+        std::string value;
+        std::string heap_value;
+        int64_t self_size;
+        int64_t retained_size;
+        int retainers;
+
+        example() : context(0), type(snapshotindex::kHidden),
+                    self_size(0), retained_size(0), retainers(0) { };
+    };
+
+    // a step along a retainer path: the edge followed, and what it led to
+    struct PathStep
+    {
+        std::string edge;
+        std::string what;
+    };
+
+    // from the root of the heap to a new instance, root first
+    typedef std::vector<PathStep> RetainerPath;
+
+    class change
+    {
+    public:
+        int64_t size;
+        int64_t added;
+        int64_t released;
+        int64_t retained;
+        std::vector<example> examples;
+        std::vector<RetainerPath> paths;
+
+        change() : size(0), added(0), released(0), retained(0) { }
+    };
+
+    // new strings holding the same contents, or the same prefix of them
+    struct StringGroup
+    {
+        std::string value;
+        // value is only the start of the strings, which run on past it
+        bool prefix;
+        int64_t count;
+        int64_t size;
+        // the size of all but the first of them
+        int64_t wasted;
+    };
+
+    // changes are aggregated in a flat array indexed by type key
+    typedef std::vector<change> changeset;
+
+    // an integer for the type a node is aggregated under, by the name
+    // it's reported under: object nodes by their interned constructor
+    // name, other nodes by their type's name (NameTable::typeName()), so
+    // an array and an Array object are counted together.  hidden and
+    // synthetic nodes represent themselves
+    inline uint32_t typeKey(uint32_t type, uint32_t name)
+    {
+        if (type != snapshotindex::kObject) {
+            name = snapshotindex::NameTable::typeName(type);
+            if (name == snapshotindex::NameTable::NO_NAME) return type;
+        }
+        return snapshotindex::kSynthetic + 1 + name;
+    }
+
+    inline uint32_t typeKey(const snapshotindex::Graph & g, uint32_t pos)
+    {
+        return typeKey(g.types[pos], g.names[pos]);
+    }
+
+    // one past the largest type key for a name table
+    inline size_t typeKeyCount(const snapshotindex::NameTable & names)
+    {
+        return snapshotindex::kSynthetic + 1 + names.size();
+    }
+
+    // the name a type is reported under, NULL for types we don't report
+    const char * typeKeyName(uint32_t key,
+                             const snapshotindex::NameTable & names);
+
+    // the types a diff reports, those that gained or lost instances, in
+    // the order they're reported: by name.  the addon and memwatch-diff
+    // both list them this way
+    void reportOrder(const changeset & changes,
+                     const snapshotindex::NameTable & names,
+                     std::vector<uint32_t> & keys);
+
+    // optional, more expensive analyses of a comparison
+    struct DiffOptions
+    {
+        // compute the dominator tree of the later snapshot, reporting
+        // retained sizes and the largest instances of each allocated type
+        bool retained;
+        unsigned int examples;
+        // find the shortest retainer paths to a few new instances of the
+        // types that grew most, this many of them.  needs edge names
+        unsigned int paths;
+        // group new strings by their first stringPrefix bytes and report
+        // this many of the groups that waste the most.  needs the later
+        // graph's strings copied
+        unsigned int strings;
+        size_t stringPrefix;
+        // the part of the heap to diff
+        snapshotindex::Filter filter;
+        // the most threads to walk, sort and merge large heaps with, 0 for
+        // one per cpu
+        unsigned int threads;
+
+        DiffOptions() : retained(false), examples(5), paths(0), strings(0),
+                        stringPrefix(128), threads(0) { }
+    };
+
+    // summary information about one side of a comparison
+    struct SnapshotSummary
+    {
+        int nodes;
+        int64_t size;
+        time_t time;
+    };
+
+    // the complete result of comparing two snapshots, built without
+    // touching V8 so that it may be computed off of the main thread
+    struct Comparison
+    {
+        SnapshotSummary before;
+        SnapshotSummary after;
+        int64_t sizeChange;
+        size_t freedNodes;
+        size_t allocatedNodes;
+        changeset changes;
+        // most wasteful first
+        std::vector<StringGroup> strings;
+    };
+
+    // a compact record of the nodes reachable in a snapshot, sorted by
+    // id.  all that a later snapshot needs to be diffed against, at a
+    // small fraction of the size of the snapshot itself.
+    struct Baseline
+    {
+        void swap(Baseline & other) {
+            std::swap(summary, other.summary);
+            ids.swap(other.ids);
+            keys.swap(other.keys);
+            sizes.swap(other.sizes);
+        }
+
+        SnapshotSummary summary;
+        std::vector<uint64_t> ids;
+        std::vector<uint32_t> keys;
+        std::vector<int> sizes;
+    };
+
+    // the columns of a baseline, wherever they live: in a Baseline, or
+    // mapped straight from a file
+    struct BaselineView
+    {
+        BaselineView() : count(0), ids(NULL), keys(NULL), sizes(NULL) { }
+        BaselineView(const Baseline & b) : summary(b.summary), count(b.ids.size()),
+            ids(count ? &b.ids[0] : NULL), keys(count ? &b.keys[0] : NULL),
+            sizes(count ? &b.sizes[0] : NULL) { }
+
+        SnapshotSummary summary;
+        size_t count;
+        const uint64_t * ids;
+        const uint32_t * keys;
+        const int * sizes;
+    };
+
+    // record the reachable nodes of a graph, those that pass the filter
+    // if one's given (prepared for the graph's names).  the caller fills
+    // in summary.time.
+    void summarize(const snapshotindex::Graph & graph, Baseline & baseline,
+                   const snapshotindex::Filter * filter = NULL,
+                   unsigned int threads = 1);
+
+    // walk both graphs, diff them and aggregate the changes by type.
+    // the caller fills in before.time and after.time.
+    void compare(const snapshotindex::Graph & before,
+                 const snapshotindex::Graph & after,
+                 const snapshotindex::NameTable & names,
+                 const DiffOptions & options,
+                 Comparison & result);
+
+    // the same, against a baseline of the earlier snapshot.  the caller
+    // fills in after.time.  if next is given it receives the baseline of
+    // the later snapshot, ready for the next comparison.
+    void compare(const BaselineView & before,
+                 const snapshotindex::Graph & after,
+                 const snapshotindex::NameTable & names,
+                 const DiffOptions & options,
+                 Comparison & result,
+                 Baseline * next = NULL);
+
+    // with nothing captured before, for heap object tracking: every
+    // reachable node with an id past since is new.  fills in the changes
+    // and allocatedNodes, the caller fills in the rest from the tracker.
+    void compareSince(uint64_t since,
+                      const snapshotindex::Graph & after,
+                      const snapshotindex::NameTable & names,
+                      const DiffOptions & options,
+                      Comparison & result);
+};
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "dominators.hh"
+
+using namespace std;
+
+static const uint32_t UNDEFINED = snapshotindex::IdIndex::NOT_FOUND;
+
+static inline bool retains(const snapshotindex::Graph & g, uint32_t edge)
+{
+    return g.edgeTypes.empty() || g.edgeTypes[edge] != snapshotindex::kWeak;
+}
+
+snapshotindex::DominatorTree::DominatorTree(const Graph & g)
+{
+    computePostorder(g);
+    computeDominators(g);
+    computeRetainedSizes(g);
+    computePreorder();
+}
+
+void
+snapshotindex::DominatorTree::computePostorder(const Graph & g)
+{
+    postorder.assign(g.nodeCount(), UNDEFINED);
+    if (g.root >= g.nodeCount()) return;
+
+    // iterative depth first search, each stack entry remembers the next
+    // edge to look at.  a node is numbered once all its edges are done.
+    vector<bool> seen(g.nodeCount(), false);
+    vector<pair<uint32_t, uint32_t> > stack;
+
+    stack.push_back(make_pair(g.root, g.firstEdge[g.root]));
+    seen[g.root] = true;
+
+    while (!stack.empty()) {
+        uint32_t n = stack.back().first;
+        uint32_t & e = stack.back().second;
+
+        if (e < g.firstEdge[n + 1]) {
+            uint32_t edge = e++;
+            uint32_t to = g.edges[edge];
+            if (!seen[to] && !g.ignored[to] && retains(g, edge)) {
+                seen[to] = true;
+                stack.push_back(make_pair(to, g.firstEdge[to]));
+            }
+        } else {
+            postorder[n] = nodes.size();
+            nodes.push_back(n);
+            stack.pop_back();
+        }
+    }
+
+    // predecessor lists in compressed form, indexed by postorder number
+    uint32_t count = nodes.size();
+    firstPred.assign(count + 1, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t n = nodes[i];
+        for (uint32_t e = g.firstEdge[n]; e < g.firstEdge[n + 1]; e++) {
+            uint32_t to = postorder[g.edges[e]];
+            if (to != UNDEFINED && retains(g, e)) firstPred[to + 1]++;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) firstPred[i + 1] += firstPred[i];
+
+    preds.resize(firstPred[count]);
+    vector<uint32_t> fill(firstPred.begin(), firstPred.end() - 1);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t n = nodes[i];
+        for (uint32_t e = g.firstEdge[n]; e < g.firstEdge[n + 1]; e++) {
+            uint32_t to = postorder[g.edges[e]];
+            if (to != UNDEFINED && retains(g, e)) preds[fill[to]++] = i;
+        }
+    }
+}
+
+void
+snapshotindex::DominatorTree::computeDominators(const Graph &)
+{
+    uint32_t count = nodes.size();
+    if (!count) return;
+
+    // the root finishes last, so it has the highest postorder number
+    uint32_t root = count - 1;
+    doms.assign(count, UNDEFINED);
+    doms[root] = root;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        // reverse postorder, skipping the root
+        for (uint32_t i = root; i-- > 0; ) {
+            uint32_t idom = UNDEFINED;
+            for (uint32_t p = firstPred[i]; p < firstPred[i + 1]; p++) {
+                uint32_t pred = preds[p];
+                if (doms[pred] == UNDEFINED) continue;
+                if (idom == UNDEFINED) {
+                    idom = pred;
+                    continue;
+                }
+                // walk both fingers up the tree until they meet
+                uint32_t f1 = pred, f2 = idom;
+                while (f1 != f2) {
+                    while (f1 < f2) f1 = doms[f1];
+                    while (f2 < f1) f2 = doms[f2];
+                }
+                idom = f1;
+            }
+            if (idom != UNDEFINED && doms[i] != idom) {
+                doms[i] = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+void
+snapshotindex::DominatorTree::computeRetainedSizes(const Graph & g)
+{
+    uint32_t count = nodes.size();
+    retained.resize(count);
+    for (uint32_t i = 0; i < count; i++) retained[i] = g.sizes[nodes[i]];
+
+    // a dominator always finishes after the nodes it dominates, so one
+    // pass in postorder folds every subtree into its parent
+    for (uint32_t i = 0; i + 1 < count; i++) {
+        if (doms[i] != UNDEFINED) retained[doms[i]] += retained[i];
+    }
+}
+
+void
+snapshotindex::DominatorTree::computePreorder()
+{
+    uint32_t count = nodes.size();
+    if (!count) return;
+
+    // children of each node in the dominator tree, again in compressed form
+    vector<uint32_t> firstChild(count + 1, 0);
+    vector<uint32_t> children;
+    for (uint32_t i = 0; i + 1 < count; i++) {
+        if (doms[i] != UNDEFINED) firstChild[doms[i] + 1]++;
+    }
+    for (uint32_t i = 0; i < count; i++) firstChild[i + 1] += firstChild[i];
+    children.resize(firstChild[count]);
+    vector<uint32_t> fill(firstChild.begin(), firstChild.end() - 1);
+    for (uint32_t i = 0; i + 1 < count; i++) {
+        if (doms[i] != UNDEFINED) children[fill[doms[i]]++] = i;
+    }
+
+    pre.reserve(count);
+    preEnd.resize(count);
+
+    // each stack entry is a postorder number and its index in pre
+    vector<pair<uint32_t, uint32_t> > stack;
+    vector<uint32_t> next(firstChild.begin(), firstChild.end() - 1);
+
+    stack.push_back(make_pair(count - 1, 0));
+    pre.push_back(nodes[count - 1]);
+
+    while (!stack.empty()) {
+        uint32_t n = stack.back().first;
+        if (next[n] < firstChild[n + 1]) {
+            uint32_t c = children[next[n]++];
+            stack.push_back(make_pair(c, (uint32_t) pre.size()));
+            pre.push_back(nodes[c]);
+        } else {
+            preEnd[stack.back().second] = pre.size();
+            stack.pop_back();
+        }
+    }
+}
+
+uint32_t
+snapshotindex::DominatorTree::dominator(uint32_t pos) const
+{
+    uint32_t i = postorder[pos];
+    if (i == UNDEFINED || doms[i] == UNDEFINED) return UNDEFINED;
+    return nodes[doms[i]];
+}
+
+int64_t
+snapshotindex::DominatorTree::retainedSize(uint32_t pos) const
+{
+    uint32_t i = postorder[pos];
+    return i == UNDEFINED ? 0 : retained[i];
+}
+
+uint32_t
+snapshotindex::DominatorTree::retainers(uint32_t pos) const
+{
+    uint32_t i = postorder[pos];
+    return i == UNDEFINED ? 0 : firstPred[i + 1] - firstPred[i];
+}
@@ -0,0 +1,65 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __DOMINATORS_HH
+#define __DOMINATORS_HH
+
+#include "snapshotindex.hh"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace snapshotindex
+{
+    // the dominator tree of a snapshot graph and the retained size of
+    // every node, computed with the iterative algorithm of Cooper, Harvey
+    // and Kennedy ("A Simple, Fast Dominance Algorithm") over flat arrays.
+    // weak edges don't retain anything and are left out, as are nodes the
+    // graph marks as ignored.
+    class DominatorTree
+    {
+      public:
+        DominatorTree(const Graph & graph);
+
+        bool reachable(uint32_t pos) const {
+            return postorder[pos] != IdIndex::NOT_FOUND;
+        }
+
+        // the immediate dominator of a node, the root is its own dominator
+        uint32_t dominator(uint32_t pos) const;
+
+        // the bytes that would be freed if this node were released
+        int64_t retainedSize(uint32_t pos) const;
+
+        // the number of (non-weak) references to a node
+        uint32_t retainers(uint32_t pos) const;
+
+        // all reachable nodes in dominator tree preorder.  the subtree
+        // dominated by preorder()[i] runs through preorder()[subtreeEnd(i)-1]
+        const std::vector<uint32_t> & preorder() const { return pre; }
+        uint32_t subtreeEnd(uint32_t i) const { return preEnd[i]; }
+
+      private:
+        void computePostorder(const Graph & g);
+        void computeDominators(const Graph & g);
+        void computeRetainedSizes(const Graph & g);
+        void computePreorder();
+
+        // per graph position: the postorder number, or NOT_FOUND
+        std::vector<uint32_t> postorder;
+
+        // the remainder are indexed by postorder number
+        std::vector<uint32_t> nodes;
+        std::vector<uint32_t> firstPred;
+        std::vector<uint32_t> preds;
+        std::vector<uint32_t> doms;
+        std::vector<int64_t> retained;
+
+        std::vector<uint32_t> pre;
+        std::vector<uint32_t> preEnd;
+    };
+};
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "gcstats.hh"
+#include "instance.hh"
+
+#include <string.h> // memset()
+
+using namespace v8;
+
+static const unsigned int SUB_BITS = 3;
+static const unsigned int SUB_BUCKETS = 1 << SUB_BITS;
+
+static inline unsigned int log2floor(uint64_t v)
+{
+    unsigned int r = 0;
+    while (v >>= 1) r++;
+    return r;
+}
+
+static inline unsigned int bucketOf(uint64_t us)
+{
+    if (us < SUB_BUCKETS) return us;
+    unsigned int e = log2floor(us);
+    unsigned int b = (e - SUB_BITS + 1) * SUB_BUCKETS +
+        ((us >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+    return b < gcstats::Histogram::BUCKETS ? b : gcstats::Histogram::BUCKETS - 1;
+}
+
+// the largest value that lands in bucket b
+static inline uint64_t bucketTop(unsigned int b)
+{
+    if (b < SUB_BUCKETS) return b;
+    unsigned int e = b / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t width = (uint64_t) 1 << (e - SUB_BITS);
+    return ((uint64_t) 1 << e) + (b % SUB_BUCKETS + 1) * width - 1;
+}
+
+gcstats::Histogram::Histogram()
+    : count(0), total(0), max(0), intervalCount(0), intervalTotal(0)
+{
+    memset(buckets, 0, sizeof(buckets));
+}
+
+void
+gcstats::Histogram::record(uint64_t us)
+{
+    buckets[bucketOf(us)]++;
+    count++;
+    total += us;
+    if (us > max) max = us;
+    intervalCount++;
+    intervalTotal += us;
+}
+
+uint64_t
+gcstats::Histogram::percentile(double p) const
+{
+    if (!count) return 0;
+    uint64_t want = (uint64_t) (p * count + 0.5);
+    if (want < 1) want = 1;
+    uint64_t seen = 0;
+    for (unsigned int b = 0; b < BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= want) {
+            // the last bucket also holds everything too big to bucket
+            if (b == BUCKETS - 1) return max;
+            uint64_t top = bucketTop(b);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+// the collections our own snapshots force aren't the program's pauses,
+// so they're left out of the histograms
+void gcstats::before_gc(GCType, GCCallbackFlags)
+{
+    memwatch::Instance * instance = memwatch::Instance::current();
+    if (!instance || instance->diff.inProgress) return;
+    instance->pauses.start = uv_hrtime();
+}
+
+void gcstats::after_gc(GCType type)
+{
+    memwatch::Instance * instance = memwatch::Instance::current();
+    if (!instance || instance->diff.inProgress || !instance->pauses.start) return;
+
+    State & pauses = instance->pauses;
+    uint64_t us = (uv_hrtime() - pauses.start) / 1000;
+    pauses.start = 0;
+    if (type == kGCTypeMarkSweepCompact) pauses.markSweep.record(us);
+    else pauses.scavenge.record(us);
+}
+
+static inline Local<Number> ms(uint64_t us)
+{
+    return Number::New(us / 1000.0);
+}
+
+static Persistent<String> symbol(const char * str)
+{
+    return Persistent<String>::New(String::NewSymbol(str));
+}
+
+static const gcstats::Keys & keys(gcstats::State & pauses)
+{
+    gcstats::Keys & key = pauses.keys;
+    if (key.count.IsEmpty()) {
+        key.count = symbol("count");
+        key.total_ms = symbol("total_ms");
+        key.p50_ms = symbol("p50_ms");
+        key.p99_ms = symbol("p99_ms");
+        key.max_ms = symbol("max_ms");
+        key.interval_count = symbol("interval_count");
+        key.interval_ms = symbol("interval_ms");
+        key.scavenge = symbol("scavenge");
+        key.mark_sweep = symbol("mark_sweep");
+    }
+    return key;
+}
+
+static Local<Object> histogramToObject(const gcstats::Keys & key,
+                                       gcstats::Histogram & h, bool resetInterval)
+{
+    Local<Object> o = Object::New();
+    o->Set(key.count, Number::New((double) h.count));
+    o->Set(key.total_ms, ms(h.total));
+    o->Set(key.p50_ms, ms(h.percentile(0.5)));
+    o->Set(key.p99_ms, ms(h.percentile(0.99)));
+    o->Set(key.max_ms, ms(h.max));
+    o->Set(key.interval_count, Number::New((double) h.intervalCount));
+    o->Set(key.interval_ms, ms(h.intervalTotal));
+    if (resetInterval) h.intervalCount = h.intervalTotal = 0;
+    return o;
+}
+
+Handle<Value> gcstats::toObject(bool resetInterval)
+{
+    HandleScope scope;
+    State & pauses = memwatch::Instance::current()->pauses;
+    const Keys & key = keys(pauses);
+    Local<Object> o = Object::New();
+    o->Set(key.scavenge, histogramToObject(key, pauses.scavenge, resetInterval));
+    o->Set(key.mark_sweep, histogramToObject(key, pauses.markSweep, resetInterval));
+    return scope.Close(o);
+}
+
+Handle<Value> gcstats::gc_stats(const Arguments&)
+{
+    HandleScope scope;
+    if (!memwatch::Instance::current()) return memwatch::Instance::missing();
+    return scope.Close(toObject(false));
+}
@@ -0,0 +1,82 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __GCSTATS_HH
+#define __GCSTATS_HH
+
+#include <node.h>
+
+#include <stdint.h>
+
+// how long GC pauses us.  the prologue callback notes the time, the
+// epilogue callback files the pause under the type of GC that ran.
+namespace gcstats
+{
+    // a fixed size log-linear histogram of durations in microseconds.
+    // durations under 8us get a bucket each, beyond that every power of
+    // two is split into 8 linear buckets, so any recorded value is off by
+    // at most 12.5%.  recording is a couple of shifts and an increment.
+    class Histogram
+    {
+      public:
+        static const unsigned int BUCKETS = 240;
+
+        Histogram();
+
+        void record(uint64_t us);
+
+        // the upper bound of the bucket holding the p'th percentile
+        // (0 < p <= 1), never more than the largest value recorded
+        uint64_t percentile(double p) const;
+
+        uint64_t count;
+        uint64_t total;
+        uint64_t max;
+
+        // pause accumulated since the last stats event
+        uint64_t intervalCount;
+        uint64_t intervalTotal;
+
+      private:
+        uint32_t buckets[BUCKETS];
+    };
+
+    // property names for pause statistics, made on first use
+    struct Keys
+    {
+        v8::Persistent<v8::String> count;
+        v8::Persistent<v8::String> total_ms;
+        v8::Persistent<v8::String> p50_ms;
+        v8::Persistent<v8::String> p99_ms;
+        v8::Persistent<v8::String> max_ms;
+        v8::Persistent<v8::String> interval_count;
+        v8::Persistent<v8::String> interval_ms;
+        v8::Persistent<v8::String> scavenge;
+        v8::Persistent<v8::String> mark_sweep;
+    };
+
+    // one isolate's pauses
+    struct State
+    {
+        State() : start(0) { }
+
+        // when the gc in progress began
+        uint64_t start;
+        Histogram scavenge;
+        Histogram markSweep;
+        Keys keys;
+    };
+
+    void before_gc(v8::GCType type, v8::GCCallbackFlags flags);
+    // called from memwatch's epilogue callback
+    void after_gc(v8::GCType type);
+
+    // scavenge and mark-sweep pause statistics as a javascript object.
+    // resetInterval starts a new interval once it has been reported
+    v8::Handle<v8::Value> toObject(bool resetInterval);
+
+    v8::Handle<v8::Value> gc_stats(const v8::Arguments& args);
+};
+
+#endif
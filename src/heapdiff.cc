@@ -3,37 +3,91 @@
  */
 
 #include "heapdiff.hh"
+#include "changeset.hh"
+#include "instance.hh"
+#include "parallel.hh"
+#include "platformcompat.hh"
+#include "snapshotcopy.hh"
+#include "snapshotfile.hh"
 #include "util.hh"
 
 #include <node.h>
 
-#include <map>
 #include <string>
-#include <set>
 #include <vector>
 
-#include <stdlib.h> // abs()
+#include <stdio.h>  // remove(), snprintf()
+#include <stdlib.h> // getenv()
 #include <time.h>   // time()
 
 using namespace v8;
 using namespace node;
 using namespace std;
 
-static bool s_inProgress = false;
-static time_t s_startTime;
+static heapdiff::Keys & keys()
+{
+    return memwatch::Instance::current()->diff.keys;
+}
+
+snapshotindex::NameTable & heapdiff::sharedNames()
+{
+    return memwatch::Instance::current()->diff.names;
+}
+
+void heapdiff::copyGraph(const HeapSnapshot * snapshot,
+                         snapshotindex::Graph & graph,
+                         snapshotindex::CopyOptions options)
+{
+    snapshotindex::copySnapshot(snapshot, sharedNames(), graph, options);
+}
+
+static Persistent<String> symbol(const char * str)
+{
+    return Persistent<String>::New(String::NewSymbol(str));
+}
 
 bool heapdiff::HeapDiff::InProgress() 
 {
-    return s_inProgress;
+    memwatch::Instance * instance = memwatch::Instance::current();
+    return instance && instance->diff.inProgress;
+}
+
+const HeapSnapshot * heapdiff::HeapDiff::TakeSnapshot()
+{
+    State & diff = memwatch::Instance::current()->diff;
+    diff.inProgress = true;
+    const HeapSnapshot * snapshot =
+        v8::HeapProfiler::TakeSnapshot(v8::String::New(""));
+    diff.inProgress = false;
+    return snapshot;
+}
+
+// mark the heap for a tracking diff.  pushing object stats collects
+// garbage, so our gc hooks stand down as they do for a snapshot
+static heapdiff::Mark markHeap(bool starting)
+{
+    heapdiff::State & diff = memwatch::Instance::current()->diff;
+    diff.inProgress = true;
+    heapdiff::Mark m = starting ? diff.tracker.start() : diff.tracker.push();
+    diff.inProgress = false;
+    return m;
 }
 
 heapdiff::HeapDiff::HeapDiff() : ObjectWrap(), before(NULL), after(NULL),
-                                 ended(false)
+                                 startTime(0), tracking(false), ended(false)
 {
 }
 
 heapdiff::HeapDiff::~HeapDiff()
 {
+    if (!spillPath.empty()) remove(spillPath.c_str());
+
+    // a tracking diff that's never ended still holds tracking on
+    if (tracking && !ended) {
+        memwatch::Instance * instance = memwatch::Instance::current();
+        if (instance) instance->diff.tracker.stop();
+    }
+
     if (before) {
         ((HeapSnapshot *) before)->Delete();
         before = NULL;
@@ -54,10 +108,94 @@ heapdiff::HeapDiff::Initialize ( v8::Handle<v8::Object> target )
     t->SetClassName(String::NewSymbol("HeapDiff"));
 
     NODE_SET_PROTOTYPE_METHOD(t, "end", End);
+    NODE_SET_PROTOTYPE_METHOD(t, "endAsync", EndAsync);
+
+    Keys & key = keys();
+    key.what = symbol("what");
+    key.size_bytes = symbol("size_bytes");
+    key.size = symbol("size");
+    key.added = symbol("+");
+    key.released = symbol("-");
+    key.retained_size_bytes = symbol("retained_size_bytes");
+    key.retained_size = symbol("retained_size");
+    key.retainers = symbol("retainers");
+    key.examples = symbol("examples");
+    key.nodes = symbol("nodes");
+    key.time = symbol("time");
+    key.before = symbol("before");
+    key.after = symbol("after");
+    key.change = symbol("change");
+    key.freed_nodes = symbol("freed_nodes");
+    key.allocated_nodes = symbol("allocated_nodes");
+    key.details = symbol("details");
+    key.paths = symbol("paths");
+    key.edge = symbol("edge");
+    key.strings = symbol("strings");
+    key.value = symbol("value");
+    key.prefix = symbol("prefix");
+    key.count = symbol("count");
+    key.wasted_bytes = symbol("wasted_bytes");
+    key.type_id = symbol("type_id");
 
     target->Set(v8::String::NewSymbol( "HeapDiff"), t->GetFunction());
 }
 
+// where a spilled baseline goes: the directory given, or the temp dir
+static std::string spillFile(Handle<Value> opt)
+{
+    std::string dir;
+    if (opt->IsString()) {
+        dir = *String::Utf8Value(opt);
+    } else {
+        const char * tmp = getenv("TMPDIR");
+#if defined(_WIN32)
+        if (!tmp) tmp = getenv("TEMP");
+#endif
+        dir = tmp ? tmp : "/tmp";
+    }
+
+    // a template, writeBaseline() makes the name unique
+    char name[64];
+    snprintf(name, sizeof(name), "/memwatch-%d-XXXXXX", (int) GETPID());
+    return dir + name;
+}
+
+bool
+heapdiff::resolveRoot(Handle<Value> arg, DiffOptions & options, std::string & err)
+{
+    if (!arg->IsObject()) return true;
+
+    HandleScope scope;
+    Local<Value> root = arg->ToObject()->Get(String::New("root"));
+    if (!root->IsObject()) return true;
+    options.filter.rootId = HeapProfiler::GetSnapshotObjectId(root);
+    if (!options.filter.rootId) err = "the root option's object isn't in the heap snapshot";
+    return options.filter.rootId != 0;
+}
+
+// snapshot the heap, boil it down to a baseline and write that to disk.
+// the snapshot is deleted as soon as it's copied, the copy as soon as
+// it's summarized.  arg holds the root, if any, resolved into options
+static bool spillBaseline(std::string & path, time_t startTime,
+                          Handle<Value> arg, heapdiff::DiffOptions & options,
+                          std::string & err)
+{
+    heapdiff::Baseline baseline;
+    {
+        snapshotindex::Graph graph;
+        const HeapSnapshot * snapshot = heapdiff::HeapDiff::TakeSnapshot();
+        heapdiff::copyGraph(snapshot, graph);
+        ((HeapSnapshot *) snapshot)->Delete();
+        if (!heapdiff::resolveRoot(arg, options, err)) return false;
+
+        snapshotindex::Filter filter = options.filter;
+        filter.prepare(heapdiff::sharedNames());
+        heapdiff::summarize(graph, baseline, &filter, options.threads);
+    }
+    baseline.summary.time = startTime;
+    return snapshotfile::writeBaseline(path, baseline, err);
+}
+
 v8::Handle<v8::Value>
 heapdiff::HeapDiff::New (const v8::Arguments& args)
 {
@@ -72,229 +210,451 @@ heapdiff::HeapDiff::New (const v8::Arguments& args)
 
     v8::HandleScope scope;
 
+    if (!memwatch::Instance::current()) return memwatch::Instance::missing();
+
     // allocate the underlying c++ class and wrap it up in the this pointer
     HeapDiff * self = new HeapDiff();
     self->Wrap(args.This());
 
-    // take a snapshot and save a pointer to it
-    s_inProgress = true;
-    s_startTime = time(NULL);
-    self->before = v8::HeapProfiler::TakeSnapshot(v8::String::New(""));
-    s_inProgress = false;
+    Local<Value> spill;
+    if (args.Length() >= 1) {
+        parseOptions(args[0], self->options);
+        if (args[0]->IsObject()) {
+            Local<Object> opts = args[0]->ToObject();
+            self->tracking = opts->Get(String::New("tracking"))->BooleanValue();
+            spill = opts->Get(String::New("spill"));
+        }
+    }
+
+    // take a snapshot and save a pointer to it, or when tracking just
+    // note where object ids are up to, or boil it down and spill it
+    // past the end, args[0] is undefined
+    Local<Value> opts = args[0];
+    std::string err;
+    self->startTime = time(NULL);
+    if (self->tracking) {
+        self->mark = markHeap(true);
+        if (!resolveRoot(opts, self->options, err)) {
+            memwatch::Instance::current()->diff.tracker.stop();
+            self->ended = true;
+            return ThrowException(Exception::Error(String::New(err.c_str())));
+        }
+    } else if (!spill.IsEmpty() && spill->BooleanValue()) {
+        self->spillPath = spillFile(spill);
+        if (!spillBaseline(self->spillPath, self->startTime, opts, self->options, err))
+        {
+            self->spillPath.clear();
+            self->ended = true;
+            return ThrowException(Exception::Error(String::New(err.c_str())));
+        }
+    } else {
+        self->before = TakeSnapshot();
+        if (!resolveRoot(opts, self->options, err)) {
+            ((HeapSnapshot *) self->before)->Delete();
+            self->before = NULL;
+            self->ended = true;
+            return ThrowException(Exception::Error(String::New(err.c_str())));
+        }
+    }
 
     return args.This();
 }
 
-static string handleToStr(const Handle<Value> & str)
+// the names types go by in diffs, and in the types option
+static const char * s_filterTypes[] = {
+    "Hidden", "Array", "String", "Object", "Code", "Closure", "RegExp",
+    "Number", "Native"
+};
+
+static uint32_t typeBit(const std::string & name)
 {
-	String::Utf8Value utfString(str->ToString());
-	return *utfString;   
+    for (uint32_t t = 0; t < sizeof(s_filterTypes) / sizeof(s_filterTypes[0]); t++) {
+        if (name == s_filterTypes[t]) return 1 << t;
+    }
+    return 0;
 }
 
-static void
-buildIDSet(set<uint64_t> * seen, const HeapGraphNode* cur, int & s)
+// a string or an array of them
+static void readStrings(Handle<Value> v, vector<std::string> & out)
 {
-    v8::HandleScope scope;
-
-    // cycle detection
-    if (seen->find(cur->GetId()) != seen->end()) {
-        return;
+    if (v->IsArray()) {
+        Handle<Array> a = Handle<Array>::Cast(v);
+        for (uint32_t i = 0; i < a->Length(); i++) {
+            out.push_back(*String::Utf8Value(a->Get(i)));
+        }
+    } else if (v->IsString()) {
+        out.push_back(*String::Utf8Value(v));
     }
-    // always ignore HeapDiff related memory
-    if (cur->GetType() == HeapGraphNode::kObject &&
-        handleToStr(cur->GetName()).compare("HeapDiff") == 0)
-    {
-        return;
+}
+
+// { types: [...], name: 'My*', minSize: n }, the root is resolveRoot()'s
+static void parseFilter(Handle<Object> opts, snapshotindex::Filter & filter)
+{
+    vector<std::string> types;
+    readStrings(opts->Get(String::New("types")), types);
+    for (size_t i = 0; i < types.size(); i++) {
+        filter.types |= typeBit(types[i]);
     }
+    // asked for types, none of which exist: an empty diff, not a full one
+    if (!types.empty() && !filter.types) filter.types = 1u << 31;
 
-    // update memory usage as we go
-    s += cur->GetSelfSize();
+    readStrings(opts->Get(String::New("name")), filter.names);
 
-    seen->insert(cur->GetId());
+    Local<Value> v = opts->Get(String::New("minSize"));
+    if (v->IsNumber()) filter.minSize = v->Int32Value();
+}
 
-    for (int i=0; i < cur->GetChildrenCount(); i++) {
-        buildIDSet(seen, cur->GetChild(i)->GetToNode(), s);
+void
+heapdiff::parseOptions(Handle<Value> arg, DiffOptions & options)
+{
+    if (!arg->IsObject()) return;
+
+    HandleScope scope;
+    Local<Object> opts = arg->ToObject();
+    Local<Value> v = opts->Get(String::New("retained"));
+    if (!v->IsUndefined()) options.retained = v->BooleanValue();
+    v = opts->Get(String::New("examples"));
+    if (v->IsNumber()) options.examples = v->Uint32Value();
+    v = opts->Get(String::New("paths"));
+    if (v->IsNumber()) options.paths = v->Uint32Value();
+    v = opts->Get(String::New("strings"));
+    if (v->IsNumber()) options.strings = v->Uint32Value();
+    v = opts->Get(String::New("stringPrefix"));
+    if (v->IsNumber() && v->IntegerValue() > 0) {
+        options.stringPrefix = (size_t) v->IntegerValue();
     }
+    v = opts->Get(String::New("threads"));
+    if (v->IsNumber()) options.threads = v->Uint32Value();
+    parseFilter(opts, options.filter);
 }
 
-typedef set<uint64_t> idset;
-
-// why doesn't STL work?
-// XXX: improve this algorithm
-void setDiff(idset a, idset b, vector<uint64_t> &c)
+snapshotindex::CopyOptions
+heapdiff::copyOptions(const DiffOptions & options, uint64_t since)
 {
-    for (idset::iterator i = a.begin(); i != a.end(); i++) {
-        if (b.find(*i) == b.end()) c.push_back(*i);
+    snapshotindex::CopyOptions copy;
+    copy.edgeNames = options.paths > 0;
+    if (options.strings) {
+        copy.stringPrefix = options.stringPrefix;
+        copy.stringsSince = since;
     }
+    return copy;
 }
 
-
-class example
+Handle<Value>
+heapdiff::force_parallel(const Arguments& args)
 {
-public:
-    HeapGraphEdge::Type context;
-    HeapGraphNode::Type type;
-    std::string name;
-    std::string value;
-    std::string heap_value;
-    int self_size;
-    int retained_size;
-    int retainers;
-
-    example() : context(HeapGraphEdge::kHidden),
-                type(HeapGraphNode::kHidden),
-                self_size(0), retained_size(0), retainers(0) { };
-};
+    HandleScope scope;
+    parallel::force(args.Length() >= 1 && args[0]->IsNumber() ? args[0]->Uint32Value() : 0);
+    return scope.Close(Undefined());
+}
 
-class change
+static Handle<Value> examplesToObject(const vector<heapdiff::example> & examples)
 {
-public:
-    long int size;
-    long int added;
-    long int released;
-    std::vector<example> examples;
+    v8::HandleScope scope;
+    heapdiff::Keys & key = keys();
+    Local<Array> a = Array::New();
 
-    change() : size(0), added(0), released(0) { }
-};
+    for (size_t i = 0; i < examples.size(); i++) {
+        Local<Object> e = Object::New();
+        e->Set(key.what, String::New(examples[i].name.c_str()));
+        e->Set(key.size_bytes, Number::New((double) examples[i].self_size));
+        e->Set(key.retained_size_bytes, Number::New((double) examples[i].retained_size));
+        e->Set(key.retainers, Integer::New(examples[i].retainers));
+        a->Set(a->Length(), e);
+    }
 
-typedef std::map<std::string, change>changeset;
+    return scope.Close(a);
+}
 
-static void manageChange(changeset & changes, const HeapGraphNode * node, bool added)
+static Handle<Value> pathsToObject(const vector<heapdiff::RetainerPath> & paths)
 {
-    std::string type;
-
-    switch(node->GetType()) {
-        case HeapGraphNode::kArray:
-            type.append("Array");
-            break;
-        case HeapGraphNode::kString:
-            type.append("String");
-            break;
-        case HeapGraphNode::kObject:
-            type.append(handleToStr(node->GetName()));
-            break;
-        case HeapGraphNode::kCode:
-            type.append("Code");
-            break;
-        case HeapGraphNode::kClosure:
-            type.append("Closure");
-            break;
-        case HeapGraphNode::kRegExp:
-            type.append("RegExp");
-            break;
-        case HeapGraphNode::kHeapNumber:
-            type.append("Number");
-            break;
-        case HeapGraphNode::kNative:
-            type.append("Native");
-            break;
-        case HeapGraphNode::kHidden:
-        default:
-            return;
-    }
-
-    if (changes.find(type) == changes.end()) {
-        changes[type] = change();
+    v8::HandleScope scope;
+    heapdiff::Keys & key = keys();
+    Local<Array> a = Array::New(paths.size());
+
+    for (size_t i = 0; i < paths.size(); i++) {
+        const heapdiff::RetainerPath & path = paths[i];
+        Local<Array> p = Array::New(path.size());
+        for (size_t j = 0; j < path.size(); j++) {
+            Local<Object> s = Object::New();
+            if (!path[j].edge.empty()) {
+                s->Set(key.edge, String::New(path[j].edge.c_str(), path[j].edge.size()));
+            }
+            s->Set(key.what, String::New(path[j].what.c_str(), path[j].what.size()));
+            p->Set(j, s);
+        }
+        a->Set(i, p);
     }
 
-    changeset::iterator i = changes.find(type);
-
-    i->second.size += node->GetSelfSize() * (added ? 1 : -1);
-    if (added) i->second.added++;
-    else i->second.released++;
+    return scope.Close(a);
+}
 
-    // XXX: example
+static Handle<Value> stringsToObject(const vector<heapdiff::StringGroup> & groups)
+{
+    v8::HandleScope scope;
+    heapdiff::Keys & key = keys();
+    Local<Array> a = Array::New(groups.size());
+
+    for (size_t i = 0; i < groups.size(); i++) {
+        const heapdiff::StringGroup & g = groups[i];
+        Local<Object> o = Object::New();
+        o->Set(key.value, String::New(g.value.c_str(), g.value.size()));
+        if (g.prefix) o->Set(key.prefix, True());
+        o->Set(key.count, Number::New((double) g.count));
+        o->Set(key.size_bytes, Number::New((double) g.size));
+        o->Set(key.wasted_bytes, Number::New((double) g.wasted));
+        o->Set(key.size, String::New(mw_util::niceSize(g.wasted).c_str()));
+        a->Set(i, o);
+    }
 
-    return;
+    return scope.Close(a);
 }
 
-static Handle<Value> changesetToObject(changeset & changes)
+// order the reported types by name, as they always have been
+static Handle<Value> changesetToObject(const heapdiff::changeset & changes,
+                                       const snapshotindex::NameTable & names,
+                                       const heapdiff::DiffOptions & options)
 {
     v8::HandleScope scope;
+    heapdiff::Keys & key = keys();
     Local<Array> a = Array::New();
 
-    for (changeset::iterator i = changes.begin(); i != changes.end(); i++) {
+    vector<uint32_t> keys;
+    heapdiff::reportOrder(changes, names, keys);
+
+    for (size_t j = 0; j < keys.size(); j++) {
+        uint32_t k = keys[j];
+        const heapdiff::change & c = changes[k];
+
         Local<Object> d = Object::New();
-        d->Set(String::New("what"), String::New(i->first.c_str()));
-        d->Set(String::New("size_bytes"), Integer::New(i->second.size));
-        d->Set(String::New("size"), String::New(mw_util::niceSize(i->second.size).c_str()));
-        d->Set(String::New("+"), Integer::New(i->second.added));
-        d->Set(String::New("-"), Integer::New(i->second.released));
+        d->Set(key.what, String::New(heapdiff::typeKeyName(k, names)));
+        d->Set(key.type_id, Integer::NewFromUnsigned(k));
+        d->Set(key.size_bytes, Number::New((double) c.size));
+        d->Set(key.size, String::New(mw_util::niceSize(c.size).c_str()));
+        d->Set(key.added, Number::New((double) c.added));
+        d->Set(key.released, Number::New((double) c.released));
+        if (options.retained && c.added) {
+            d->Set(key.retained_size_bytes, Number::New((double) c.retained));
+            d->Set(key.retained_size, String::New(mw_util::niceSize(c.retained).c_str()));
+            d->Set(key.examples, examplesToObject(c.examples));
+        }
+        if (!c.paths.empty()) d->Set(key.paths, pathsToObject(c.paths));
         a->Set(a->Length(), d);
     }
 
     return scope.Close(a);
 }
 
-
-static v8::Handle<Value>
-compare(const v8::HeapSnapshot * before, const v8::HeapSnapshot * after)
+v8::Handle<Value>
+heapdiff::comparisonToObject(const Comparison & cmp,
+                             const snapshotindex::NameTable & names,
+                             const DiffOptions & options)
 {
     v8::HandleScope scope;
-    int s, diffBytes;
+    Keys & key = keys();
 
     Local<Object> o = Object::New();
 
     // first let's append summary information
     Local<Object> b = Object::New();
-    b->Set(String::New("nodes"), Integer::New(before->GetNodesCount()));
-    b->Set(String::New("time"), NODE_UNIXTIME_V8(s_startTime));
-    o->Set(String::New("before"), b);
+    b->Set(key.nodes, Integer::New(cmp.before.nodes));
+    b->Set(key.time, NODE_UNIXTIME_V8(cmp.before.time));
+    b->Set(key.size_bytes, Number::New((double) cmp.before.size));
+    b->Set(key.size, String::New(mw_util::niceSize(cmp.before.size).c_str()));
+    o->Set(key.before, b);
 
     Local<Object> a = Object::New();
-    a->Set(String::New("nodes"), Integer::New(after->GetNodesCount()));
-    a->Set(String::New("time"), NODE_UNIXTIME_V8(time(NULL)));
-    o->Set(String::New("after"), a);
+    a->Set(key.nodes, Integer::New(cmp.after.nodes));
+    a->Set(key.time, NODE_UNIXTIME_V8(cmp.after.time));
+    a->Set(key.size_bytes, Number::New((double) cmp.after.size));
+    a->Set(key.size, String::New(mw_util::niceSize(cmp.after.size).c_str()));
+    o->Set(key.after, a);
 
-    // now let's get allocations by name
-    set<uint64_t> beforeIDs, afterIDs;
-    s = 0;
-    buildIDSet(&beforeIDs, before->GetRoot(), s);
-    b->Set(String::New("size_bytes"), Integer::New(s));
-    b->Set(String::New("size"), String::New(mw_util::niceSize(s).c_str()));
+    Local<Object> c = Object::New();
+    c->Set(key.size_bytes, Number::New((double) cmp.sizeChange));
+    c->Set(key.size, String::New(mw_util::niceSize(cmp.sizeChange).c_str()));
+    c->Set(key.freed_nodes, Number::New((double) cmp.freedNodes));
+    c->Set(key.allocated_nodes, Number::New((double) cmp.allocatedNodes));
+    c->Set(key.details, changesetToObject(cmp.changes, names, options));
+    if (options.strings) c->Set(key.strings, stringsToObject(cmp.strings));
+    o->Set(key.change, c);
 
-    diffBytes = s;
-    s = 0;
-    buildIDSet(&afterIDs, after->GetRoot(), s);
-    a->Set(String::New("size_bytes"), Integer::New(s));
-    a->Set(String::New("size"), String::New(mw_util::niceSize(s).c_str()));
+    return scope.Close(o);
+}
 
-    diffBytes = s - diffBytes;
+// everything a comparison needs, copied out of V8 so the heavy lifting
+// can happen on the thread pool
+struct DiffJob {
+    uv_work_t req;
+    Persistent<Function> cb;
+    // the HeapDiff js object, held so it isn't collected mid-comparison
+    Persistent<Object> self;
+    // how the earlier heap is known: as a graph, by a tracking mark (nodes
+    // with ids past since are new), or as a baseline spilled to disk
+    enum Kind { kGraph, kTracking, kSpilled };
+
+    DiffJob() : kind(kGraph), since(0) { }
+
+    heapdiff::DiffOptions options;
+    Kind kind;
+    uint64_t since;
+    // the isolate's names as of the last copy, ours to read off-thread
+    snapshotindex::NameTable names;
+    snapshotindex::Graph before;
+    snapshotfile::BaselineFile spilled;
+    snapshotindex::Graph after;
+    heapdiff::Comparison result;
+};
 
-    Local<Object> c = Object::New();
-    c->Set(String::New("size_bytes"), Integer::New(diffBytes));
-    c->Set(String::New("size"), String::New(mw_util::niceSize(diffBytes).c_str()));
-    o->Set(String::New("change"), c);
-
-    // before - after will reveal nodes released (memory freed)
-    vector<uint64_t> changedIDs;
-    setDiff(beforeIDs, afterIDs, changedIDs);
-    c->Set(String::New("freed_nodes"), Integer::New(changedIDs.size()));
-
-    // here's where we'll collect all the summary information
-    changeset changes;
-
-    // for each of these nodes, let's aggregate the change information
-    for (unsigned long i = 0; i < changedIDs.size(); i++) {
-        const HeapGraphNode * n = before->GetNodeById(changedIDs[i]);
-        manageChange(changes, n, false);
-    }
+// take the second snapshot and copy both into the job.  free early, free
+// often.  I mean, after all, this process we're in is probably having
+// memory problems.  We want to help her.
+static void
+prepareJob(time_t startTime, const HeapSnapshot * & before,
+           const HeapSnapshot * & after, DiffJob * job)
+{
+    job->result.before.time = startTime;
+
+    heapdiff::copyGraph(before, job->before);
+    ((HeapSnapshot *) before)->Delete();
+    before = NULL;
+
+    // ids only go up, anything newer than the earlier heap is new
+    const vector<uint64_t> & ids = job->before.ids;
+    uint64_t since = ids.empty() ? 0 : *max_element(ids.begin(), ids.end());
+
+    after = heapdiff::HeapDiff::TakeSnapshot();
+    job->result.after.time = time(NULL);
+
+    heapdiff::copyGraph(after, job->after, heapdiff::copyOptions(job->options, since));
+    ((HeapSnapshot *) after)->Delete();
+    after = NULL;
+
+    job->names = heapdiff::sharedNames();
+}
+
+// a tracking diff's only snapshot is taken here.  the summary figures
+// come from the tracker, which counts every object in the heap; the
+// snapshot resolves just the new ones to types.
+static void
+prepareTrackingJob(time_t startTime, const heapdiff::Mark & mark,
+                   const HeapSnapshot * & after, DiffJob * job)
+{
+    heapdiff::Comparison & result = job->result;
+    heapdiff::ObjectTracker & tracker = memwatch::Instance::current()->diff.tracker;
+
+    heapdiff::Mark end = markHeap(false);
+    int64_t survivors, survivorSize;
+    tracker.live(0, mark.fragment, survivors, survivorSize);
+    tracker.stop();
+
+    result.before.nodes = (int) mark.count;
+    result.before.size = mark.size;
+    result.before.time = startTime;
+    result.after.nodes = (int) end.count;
+    result.after.size = end.size;
+    result.sizeChange = end.size - mark.size;
+    result.freedNodes = (size_t) (mark.count - survivors);
+
+    job->kind = DiffJob::kTracking;
+    job->since = mark.lastId;
+
+    after = heapdiff::HeapDiff::TakeSnapshot();
+    result.after.time = time(NULL);
+
+    heapdiff::copyGraph(after, job->after,
+                        heapdiff::copyOptions(job->options, job->since));
+    ((HeapSnapshot *) after)->Delete();
+    after = NULL;
+
+    job->names = heapdiff::sharedNames();
+}
+
+// a spilled diff holds one snapshot at a time: the later one is copied
+// and deleted, then compared against the baseline mapped back from disk.
+// the file is unlinked once it's mapped.
+static bool
+prepareSpilledJob(std::string & path, const HeapSnapshot * & after,
+                  DiffJob * job, std::string & err)
+{
+    job->kind = DiffJob::kSpilled;
+
+    bool ok = job->spilled.open(path.c_str(),
+                                heapdiff::typeKeyCount(heapdiff::sharedNames()), err);
+    remove(path.c_str());
+    path.clear();
+    if (!ok) return false;
 
-    changedIDs.clear();
+    // the baseline is sorted by id, its last is the newest
+    const heapdiff::BaselineView view = job->spilled.view();
+    uint64_t since = view.count ? view.ids[view.count - 1] : 0;
 
-    // after - before will reveal nodes added (memory allocated)
-    setDiff(afterIDs, beforeIDs, changedIDs);
+    after = heapdiff::HeapDiff::TakeSnapshot();
+    job->result.after.time = time(NULL);
 
-    c->Set(String::New("allocated_nodes"), Integer::New(changedIDs.size()));
+    heapdiff::copyGraph(after, job->after, heapdiff::copyOptions(job->options, since));
+    ((HeapSnapshot *) after)->Delete();
+    after = NULL;
 
-    for (unsigned long i = 0; i < changedIDs.size(); i++) {
-        const HeapGraphNode * n = after->GetNodeById(changedIDs[i]);
-        manageChange(changes, n, true);
+    job->names = heapdiff::sharedNames();
+    return true;
+}
+
+static void
+runJob(DiffJob * job)
+{
+    switch (job->kind) {
+        case DiffJob::kTracking:
+            heapdiff::compareSince(job->since, job->after, job->names,
+                                   job->options, job->result);
+            break;
+        case DiffJob::kSpilled:
+            heapdiff::compare(job->spilled.view(), job->after, job->names,
+                              job->options, job->result);
+            break;
+        default:
+            heapdiff::compare(job->before, job->after, job->names,
+                              job->options, job->result);
+            break;
     }
+}
 
-    c->Set(String::New("details"), changesetToObject(changes));
+static void AsyncDiffWork(uv_work_t * req)
+{
+    runJob((DiffJob *) req->data);
+}
 
-    return scope.Close(o);
+static void AsyncDiffAfter(uv_work_t * req)
+{
+    HandleScope scope;
+
+    DiffJob * job = (DiffJob *) req->data;
+
+    Handle<Value> argv[2];
+    argv[0] = Null();
+    argv[1] = heapdiff::comparisonToObject(job->result, job->names, job->options);
+
+    TryCatch try_catch;
+    job->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    job->cb.Dispose();
+    job->self.Dispose();
+    delete job;
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+}
+
+// How shall we deal with double .end()ing?  The only reasonable
+// approach seems to be an exception, cause nothing else makes
+// sense.
+static v8::Handle<Value> alreadyEnded()
+{
+    return v8::ThrowException(
+        v8::Exception::Error(
+            v8::String::New("attempt to end() a HeapDiff that was "
+                            "already ended")));
 }
 
 v8::Handle<Value>
@@ -305,28 +665,66 @@ heapdiff::HeapDiff::End( const Arguments& args )
 
     HeapDiff *t = Unwrap<HeapDiff>( args.This() );
 
-    // How shall we deal with double .end()ing?  The only reasonable
-    // approach seems to be an exception, cause nothing else makes
-    // sense.
-    if (t->ended) {
-        return v8::ThrowException(
-            v8::Exception::Error(
-                v8::String::New("attempt to end() a HeapDiff that was "
-                                "already ended")));
+    if (t->ended) return alreadyEnded();
+    t->ended = true;
+
+    DiffJob job;
+    job.options = t->options;
+    std::string err;
+    if (t->tracking) {
+        prepareTrackingJob(t->startTime, t->mark, t->after, &job);
+    } else if (!t->spillPath.empty()) {
+        if (!prepareSpilledJob(t->spillPath, t->after, &job, err)) {
+            return ThrowException(Exception::Error(String::New(err.c_str())));
+        }
+    } else {
+        prepareJob(t->startTime, t->before, t->after, &job);
+    }
+    runJob(&job);
+
+    return scope.Close(comparisonToObject(job.result, job.names, job.options));
+}
+
+v8::Handle<Value>
+heapdiff::HeapDiff::EndAsync( const Arguments& args )
+{
+    // take another snapshot, then compare them on the thread pool
+    v8::HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsFunction()) {
+        return ThrowException(
+            Exception::TypeError(
+                String::New("endAsync() requires a callback function")));
     }
+
+    HeapDiff *t = Unwrap<HeapDiff>( args.This() );
+
+    if (t->ended) return alreadyEnded();
+
+    uv_loop_t * loop = memwatch::Instance::current()->loop;
+    if (!loop) return memwatch::Instance::offLoop("endAsync()");
     t->ended = true;
 
-    s_inProgress = true;
-    t->after = v8::HeapProfiler::TakeSnapshot(v8::String::New(""));
-    s_inProgress = false;
+    DiffJob * job = new DiffJob;
+    job->options = t->options;
+    std::string err;
+    if (t->tracking) {
+        prepareTrackingJob(t->startTime, t->mark, t->after, job);
+    } else if (!t->spillPath.empty()) {
+        if (!prepareSpilledJob(t->spillPath, t->after, job, err)) {
+            delete job;
+            return ThrowException(Exception::Error(String::New(err.c_str())));
+        }
+    } else {
+        prepareJob(t->startTime, t->before, t->after, job);
+    }
+
+    job->cb = Persistent<Function>::New(Handle<Function>::Cast(args[0]));
+    job->self = Persistent<Object>::New(args.This());
+    job->req.data = (void *) job;
 
-    v8::Handle<Value> comparison = compare(t->before, t->after);
-    // free early, free often.  I mean, after all, this process we're in is
-    // probably having memory problems.  We want to help her.
-    ((HeapSnapshot *) t->before)->Delete();
-    t->before = NULL;
-    ((HeapSnapshot *) t->after)->Delete();
-    t->after = NULL;
+    uv_queue_work(loop, &(job->req),
+                  AsyncDiffWork, (uv_after_work_cb)AsyncDiffAfter);
 
-    return scope.Close(comparison);
+    return scope.Close(Undefined());
 }
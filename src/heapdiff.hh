@@ -9,8 +9,94 @@
 #include <v8-profiler.h>
 #include <node.h>
 
+#include "changeset.hh"
+#include "objecttracker.hh"
+#include "snapshotcopy.hh"
+
+#include <string>
+
 namespace heapdiff 
 {
+    // property names and builtin type names for diff output, created once
+    // per isolate
+    struct Keys
+    {
+        v8::Persistent<v8::String> what;
+        v8::Persistent<v8::String> size_bytes;
+        v8::Persistent<v8::String> size;
+        v8::Persistent<v8::String> added;
+        v8::Persistent<v8::String> released;
+        v8::Persistent<v8::String> retained_size_bytes;
+        v8::Persistent<v8::String> retained_size;
+        v8::Persistent<v8::String> retainers;
+        v8::Persistent<v8::String> examples;
+        v8::Persistent<v8::String> nodes;
+        v8::Persistent<v8::String> time;
+        v8::Persistent<v8::String> before;
+        v8::Persistent<v8::String> after;
+        v8::Persistent<v8::String> change;
+        v8::Persistent<v8::String> freed_nodes;
+        v8::Persistent<v8::String> allocated_nodes;
+        v8::Persistent<v8::String> details;
+        v8::Persistent<v8::String> paths;
+        v8::Persistent<v8::String> edge;
+        v8::Persistent<v8::String> strings;
+        v8::Persistent<v8::String> value;
+        v8::Persistent<v8::String> prefix;
+        v8::Persistent<v8::String> count;
+        v8::Persistent<v8::String> wasted_bytes;
+        v8::Persistent<v8::String> type_id;
+    };
+
+    // one isolate's diffing
+    struct State
+    {
+        State() : inProgress(false) { }
+
+        // a snapshot is being taken, our gc hooks stand down
+        bool inProgress;
+        Keys keys;
+        ObjectTracker tracker;
+        // every name any diff in this isolate has seen, so a type keeps
+        // its key from one diff to the next.  main thread only, jobs on
+        // the thread pool take a copy
+        snapshotindex::NameTable names;
+    };
+
+    // the isolate's name table
+    snapshotindex::NameTable & sharedNames();
+
+    // copy a snapshot, naming its nodes in the isolate's table, so a type
+    // has the same key in every diff
+    void copyGraph(const v8::HeapSnapshot * snapshot,
+                   snapshotindex::Graph & graph,
+                   snapshotindex::CopyOptions options = snapshotindex::CopyOptions());
+
+    // read { retained: bool, examples: n } into options
+    void parseOptions(v8::Handle<v8::Value> arg, DiffOptions & options);
+
+    // V8 only has ids for objects a snapshot (or object tracking) has
+    // seen, so { root: obj } is looked up once the earlier heap has been
+    // taken.  false, with the reason in err, if a root was given and it
+    // has no id
+    bool resolveRoot(v8::Handle<v8::Value> arg, DiffOptions & options,
+                     std::string & err);
+
+    // how to copy the later snapshot of a diff with these options.  the
+    // earlier heap held no node with an id past since
+    snapshotindex::CopyOptions copyOptions(const DiffOptions & options,
+                                           uint64_t since);
+
+    // the report returned to javascript for a comparison
+    v8::Handle<v8::Value> comparisonToObject(
+        const Comparison & cmp, const snapshotindex::NameTable & names,
+        const DiffOptions & options);
+
+    // memwatch._forceParallel(n) splits diffs into parts of as few as n
+    // nodes, whatever the cpu count, so tests reach the parallel code.  0
+    // undoes it
+    v8::Handle<v8::Value> force_parallel(const v8::Arguments& args);
+
     class HeapDiff : public node::ObjectWrap
     {
       public:
@@ -18,7 +104,10 @@ namespace heapdiff
 
         static v8::Handle<v8::Value> New( const v8::Arguments& args );
         static v8::Handle<v8::Value> End( const v8::Arguments& args );
+        static v8::Handle<v8::Value> EndAsync( const v8::Arguments& args );
         static bool InProgress();
+        // take a snapshot, suppressing our gc hooks while it runs
+        static const v8::HeapSnapshot * TakeSnapshot();
 
       protected:
         HeapDiff();
@@ -26,6 +115,14 @@ namespace heapdiff
       private:
         const v8::HeapSnapshot * before;
         const v8::HeapSnapshot * after;
+        time_t startTime;
+        // { tracking: true } diffs take no snapshot up front, just a mark
+        bool tracking;
+        Mark mark;
+        // { spill: true } diffs keep the before heap as a baseline on disk.
+        // empty once it's mapped
+        std::string spillPath;
+        DiffOptions options;
         bool ended;
     };
 };
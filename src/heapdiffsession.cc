@@ -0,0 +1,193 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "heapdiffsession.hh"
+#include "heapdiff.hh"
+#include "instance.hh"
+#include "snapshotcopy.hh"
+
+#include <node.h>
+
+#include <time.h> // time()
+
+using namespace v8;
+using namespace node;
+
+struct CheckpointJob {
+    uv_work_t req;
+    Persistent<Function> cb;
+    // the session js object, held so it isn't collected mid-checkpoint
+    Persistent<Object> handle;
+    heapdiff::HeapDiffSession * self;
+    // the isolate's names as of the copy, ours to read off-thread
+    snapshotindex::NameTable names;
+    snapshotindex::Graph graph;
+    heapdiff::Comparison result;
+    heapdiff::Baseline next;
+};
+
+// snapshot the heap and copy it out, the snapshot itself goes right away
+static void takeGraph(snapshotindex::Graph & graph,
+                      const snapshotindex::CopyOptions & options =
+                          snapshotindex::CopyOptions())
+{
+    const HeapSnapshot * snapshot = heapdiff::HeapDiff::TakeSnapshot();
+    heapdiff::copyGraph(snapshot, graph, options);
+    ((HeapSnapshot *) snapshot)->Delete();
+}
+
+heapdiff::HeapDiffSession::HeapDiffSession() : ObjectWrap(), busy(false)
+{
+}
+
+heapdiff::HeapDiffSession::~HeapDiffSession()
+{
+}
+
+void
+heapdiff::HeapDiffSession::Initialize ( v8::Handle<v8::Object> target )
+{
+    v8::HandleScope scope;
+    v8::Local<v8::FunctionTemplate> t = v8::FunctionTemplate::New(New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    t->SetClassName(String::NewSymbol("HeapDiffSession"));
+
+    NODE_SET_PROTOTYPE_METHOD(t, "checkpoint", Checkpoint);
+    NODE_SET_PROTOTYPE_METHOD(t, "checkpointAsync", CheckpointAsync);
+
+    target->Set(v8::String::NewSymbol( "HeapDiffSession"), t->GetFunction());
+}
+
+v8::Handle<v8::Value>
+heapdiff::HeapDiffSession::New (const v8::Arguments& args)
+{
+    if (!args.IsConstructCall()) {
+        return ThrowException(
+            Exception::TypeError(
+                String::New("Use the new operator to create instances of this object.")));
+    }
+
+    v8::HandleScope scope;
+
+    if (!memwatch::Instance::current()) return memwatch::Instance::missing();
+
+    HeapDiffSession * self = new HeapDiffSession();
+    self->Wrap(args.This());
+
+    if (args.Length() >= 1) parseOptions(args[0], self->options);
+
+    // the first baseline
+    snapshotindex::Graph graph;
+    takeGraph(graph);
+    std::string err;
+    if (args.Length() >= 1 && !resolveRoot(args[0], self->options, err)) {
+        return ThrowException(Exception::Error(String::New(err.c_str())));
+    }
+    snapshotindex::Filter filter = self->options.filter;
+    filter.prepare(sharedNames());
+    summarize(graph, self->baseline, &filter, self->options.threads);
+    self->baseline.summary.time = time(NULL);
+
+    return args.This();
+}
+
+static v8::Handle<Value> busyError()
+{
+    return ThrowException(
+        Exception::Error(
+            String::New("a checkpoint of this HeapDiffSession is already in progress")));
+}
+
+v8::Handle<Value>
+heapdiff::HeapDiffSession::Checkpoint( const Arguments& args )
+{
+    v8::HandleScope scope;
+
+    HeapDiffSession * self = Unwrap<HeapDiffSession>( args.This() );
+    if (self->busy) return busyError();
+
+    Comparison result;
+    Baseline next;
+    {
+        snapshotindex::Graph graph;
+        takeGraph(graph, copyOptions(self->options, self->newest()));
+        result.after.time = time(NULL);
+        compare(self->baseline, graph, sharedNames(), self->options, result,
+                &next);
+    }
+    self->baseline.swap(next);
+
+    return scope.Close(comparisonToObject(result, sharedNames(), self->options));
+}
+
+void
+heapdiff::HeapDiffSession::AsyncWork(uv_work_t * req)
+{
+    CheckpointJob * job = (CheckpointJob *) req->data;
+    HeapDiffSession * self = job->self;
+
+    compare(self->baseline, job->graph, job->names, self->options,
+            job->result, &job->next);
+}
+
+void
+heapdiff::HeapDiffSession::AsyncAfter(uv_work_t * req)
+{
+    HandleScope scope;
+    CheckpointJob * job = (CheckpointJob *) req->data;
+    HeapDiffSession * self = job->self;
+
+    self->baseline.swap(job->next);
+    self->busy = false;
+
+    Handle<Value> argv[2];
+    argv[0] = Null();
+    argv[1] = comparisonToObject(job->result, job->names, self->options);
+
+    TryCatch try_catch;
+    job->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    job->cb.Dispose();
+    job->handle.Dispose();
+    delete job;
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+}
+
+v8::Handle<Value>
+heapdiff::HeapDiffSession::CheckpointAsync( const Arguments& args )
+{
+    v8::HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsFunction()) {
+        return ThrowException(
+            Exception::TypeError(
+                String::New("checkpointAsync() requires a callback function")));
+    }
+
+    HeapDiffSession * self = Unwrap<HeapDiffSession>( args.This() );
+    if (self->busy) return busyError();
+
+    uv_loop_t * loop = memwatch::Instance::current()->loop;
+    if (!loop) return memwatch::Instance::offLoop("checkpointAsync()");
+
+    CheckpointJob * job = new CheckpointJob;
+    takeGraph(job->graph, copyOptions(self->options, self->newest()));
+    job->names = sharedNames();
+    job->result.after.time = time(NULL);
+    job->cb = Persistent<Function>::New(Handle<Function>::Cast(args[0]));
+    job->handle = Persistent<Object>::New(args.This());
+    job->self = self;
+    job->req.data = (void *) job;
+
+    // the baseline belongs to the worker until AsyncAfter
+    self->busy = true;
+
+    uv_queue_work(loop, &(job->req), AsyncWork,
+                  (uv_after_work_cb) AsyncAfter);
+
+    return scope.Close(Undefined());
+}
@@ -0,0 +1,50 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __HEAPDIFFSESSION_HH
+#define __HEAPDIFFSESSION_HH
+
+#include <v8.h>
+#include <node.h>
+
+#include "changeset.hh"
+
+namespace heapdiff
+{
+    // continuous heap diffing.  rather than holding snapshots, a session
+    // keeps only a compact baseline (id, type and size of every reachable
+    // node) of the last checkpoint.  each checkpoint diffs a fresh
+    // snapshot against that baseline and then becomes the new baseline.
+    class HeapDiffSession : public node::ObjectWrap
+    {
+      public:
+        static void Initialize ( v8::Handle<v8::Object> target );
+
+        static v8::Handle<v8::Value> New( const v8::Arguments& args );
+        static v8::Handle<v8::Value> Checkpoint( const v8::Arguments& args );
+        static v8::Handle<v8::Value> CheckpointAsync( const v8::Arguments& args );
+
+      protected:
+        HeapDiffSession();
+        ~HeapDiffSession();
+
+      private:
+        static void AsyncWork(uv_work_t * req);
+        static void AsyncAfter(uv_work_t * req);
+
+        // the id of the newest node in the baseline
+        uint64_t newest() const {
+            return baseline.ids.empty() ? 0 : baseline.ids.back();
+        }
+
+        DiffOptions options;
+        // type keys refer to the isolate's names, which only ever grow,
+        // so they stay valid from one checkpoint to the next
+        Baseline baseline;
+        // an asynchronous checkpoint is using the baseline
+        bool busy;
+    };
+};
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "heaphistory.hh"
+
+#include <math.h> // sqrt()
+
+static const char * s_names[heaphistory::kSeriesCount] = {
+    "used", "total", "executable", "external", "unused", "rss", "malloc"
+};
+
+const char * heaphistory::seriesName(Series s)
+{
+    return s_names[s];
+}
+
+void
+heaphistory::Trend::add(double x, double y)
+{
+    n++;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+    syy += y * y;
+}
+
+void
+heaphistory::Trend::remove(double x, double y)
+{
+    n--;
+    sx -= x;
+    sy -= y;
+    sxx -= x * x;
+    sxy -= x * y;
+    syy -= y * y;
+}
+
+void
+heaphistory::Trend::shift(double d)
+{
+    sxx -= 2 * d * sx - n * d * d;
+    sxy -= d * sy;
+    sx -= n * d;
+}
+
+double
+heaphistory::Trend::slope() const
+{
+    if (n < 2) return 0;
+    double d = n * sxx - sx * sx;
+    return d ? (n * sxy - sx * sy) / d : 0;
+}
+
+double
+heaphistory::Trend::slopeError() const
+{
+    if (n < 3) return 0;
+    double xx = sxx - sx * sx / n;
+    double xy = sxy - sx * sy / n;
+    double yy = syy - sy * sy / n;
+    if (xx <= 0) return 0;
+    // residual sum of squares, rounding can take it just below zero
+    double rss = yy - xy * xy / xx;
+    if (rss < 0) rss = 0;
+    return sqrt(rss / (n - 2) / xx);
+}
+
+void
+heaphistory::History::push(const Sample & s)
+{
+    // a sample's x is its position in the ring, so the sums stay small
+    // enough for doubles to hold them exactly however long we run
+    if (len == CAPACITY) {
+        const Sample & old = samples[start];
+        for (int i = 0; i < kSeriesCount; i++) {
+            trends[i].remove(0, (double) old.values[i]);
+            trends[i].shift(1);
+        }
+        start = (start + 1) % CAPACITY;
+        len--;
+    }
+
+    samples[(start + len) % CAPACITY] = s;
+    for (int i = 0; i < kSeriesCount; i++) {
+        trends[i].add((double) len, (double) s.values[i]);
+    }
+    len++;
+}
@@ -0,0 +1,95 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __HEAPHISTORY_HH
+#define __HEAPHISTORY_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// what the heap looked like after each of the last so many compactions.
+// V8 only reports the heap as a whole (not space by space), so we keep
+// the figures it does give us, plus the gap between what's committed and
+// what's used, which is where fragmentation and large object churn show
+// up.  everything lives in a fixed size ring and every query is O(1)
+// without allocating.
+namespace heaphistory
+{
+    enum Series {
+        kUsed = 0,
+        kTotal,
+        kExecutable,
+        kExternal,
+        // total - used: committed but holding nothing live
+        kUnused,
+        // outside the heap: the process's resident set, and what malloc
+        // has handed out (0 where we can't tell)
+        kRss,
+        kMalloc,
+        kSeriesCount
+    };
+
+    const char * seriesName(Series s);
+
+    struct Sample
+    {
+        time_t time;
+        int64_t values[kSeriesCount];
+        // the heap can't grow past this
+        int64_t limit;
+    };
+
+    // a least squares fit of y against sample number over a sliding
+    // window, kept as running sums so adding and expiring samples are
+    // both constant time
+    class Trend
+    {
+      public:
+        Trend() : n(0), sx(0), sy(0), sxx(0), sxy(0), syy(0) { }
+
+        void add(double x, double y);
+        void remove(double x, double y);
+        // move every point d to the left
+        void shift(double d);
+
+        size_t count() const { return n; }
+        // change in y per unit of x, 0 until we have two points
+        double slope() const;
+        // the standard error of slope(), 0 until we have three points
+        double slopeError() const;
+
+      private:
+        size_t n;
+        double sx, sy, sxx, sxy, syy;
+    };
+
+    class History
+    {
+      public:
+        static const size_t CAPACITY = 128;
+
+        History() : start(0), len(0) { }
+
+        void push(const Sample & s);
+
+        size_t size() const { return len; }
+        // 0 is the oldest sample held, size() - 1 the newest
+        const Sample & at(size_t i) const {
+            return samples[(start + i) % CAPACITY];
+        }
+        const Sample & latest() const { return at(len - 1); }
+
+        // bytes per compaction, over the samples held
+        double slope(Series s) const { return trends[s].slope(); }
+
+      private:
+        Sample samples[CAPACITY];
+        Trend trends[kSeriesCount];
+        size_t start;
+        size_t len;
+    };
+};
+
+#endif
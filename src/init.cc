@@ -5,19 +5,54 @@
 #include <v8.h>
 #include <node.h>
 
+#include "census.hh"
+#include "gcstats.hh"
 #include "heapdiff.hh"
+#include "heapdiffsession.hh"
+#include "instance.hh"
 #include "memwatch.hh"
+#include "snapshotwriter.hh"
 
 extern "C" {
     void init (v8::Handle<v8::Object> target)
     {
         v8::HandleScope scope;
+
+        // state is per isolate, and so are gc callbacks.  the module may
+        // be loaded more than once into an isolate, hook gc only the once.
+        // node gives addons no loop but the default one, which only the
+        // first thread to load us may use (see Instance::create())
+        bool fresh;
+        if (!memwatch::Instance::create(uv_default_loop(), fresh)) {
+            v8::ThrowException(v8::Exception::Error(v8::String::New(
+                "memwatch can't load, another addon holds this isolate's data slot")));
+            return;
+        }
+
         heapdiff::HeapDiff::Initialize(target);
+        heapdiff::HeapDiffSession::Initialize(target);
 
         NODE_SET_METHOD(target, "upon_gc", memwatch::upon_gc);
         NODE_SET_METHOD(target, "gc", memwatch::trigger_gc);
+        NODE_SET_METHOD(target, "gc_stats", gcstats::gc_stats);
+        NODE_SET_METHOD(target, "heap_stats", memwatch::heap_stats);
+        NODE_SET_METHOD(target, "process_stats", memwatch::process_stats);
+        NODE_SET_METHOD(target, "configure_leak_detector", memwatch::configure_leak_detector);
+        NODE_SET_METHOD(target, "simulate_leak_detector", memwatch::simulate_leak_detector);
+        NODE_SET_METHOD(target, "configure_stats", memwatch::configure_stats);
+        NODE_SET_METHOD(target, "set_listeners", memwatch::set_listeners);
+        NODE_SET_METHOD(target, "set_sampling", census::set_sampling);
+        NODE_SET_METHOD(target, "census", census::take_census);
+        NODE_SET_METHOD(target, "set_census_interval", census::set_census_interval);
+        NODE_SET_METHOD(target, "write_snapshot", snapshotwriter::write_snapshot);
+        NODE_SET_METHOD(target, "write_binary_snapshot", snapshotwriter::write_binary_snapshot);
+        NODE_SET_METHOD(target, "force_parallel", heapdiff::force_parallel);
 
-        v8::V8::AddGCEpilogueCallback(memwatch::after_gc);
+        if (fresh) {
+            memwatch::start();
+            v8::V8::AddGCPrologueCallback(gcstats::before_gc);
+            v8::V8::AddGCEpilogueCallback(memwatch::after_gc);
+        }
     }
 
     NODE_MODULE(memwatch, init);
@@ -0,0 +1,222 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "instance.hh"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+using namespace v8;
+using namespace std;
+
+// "mwat", marks an isolate data slot as ours
+static const uint32_t SLOT_TAG = 0x6d776174;
+
+// the instances made on the current thread, released as it exits
+typedef vector<memwatch::Instance *> ThreadInstances;
+
+static void releaseThread(void * arg);
+
+#if defined(_WIN32)
+static DWORD s_threadKey;
+
+static VOID WINAPI onThreadExit(PVOID arg)
+{
+    releaseThread(arg);
+}
+
+static void initThreadKey()
+{
+    s_threadKey = FlsAlloc(onThreadExit);
+}
+
+static ThreadInstances * threadInstances()
+{
+    return (ThreadInstances *) FlsGetValue(s_threadKey);
+}
+
+static void setThreadInstances(ThreadInstances * list)
+{
+    FlsSetValue(s_threadKey, list);
+}
+
+typedef DWORD ThreadId;
+
+static ThreadId currentThread()
+{
+    return GetCurrentThreadId();
+}
+
+static bool sameThread(ThreadId a, ThreadId b)
+{
+    return a == b;
+}
+#else
+static pthread_key_t s_threadKey;
+
+static void initThreadKey()
+{
+    pthread_key_create(&s_threadKey, releaseThread);
+}
+
+static ThreadInstances * threadInstances()
+{
+    return (ThreadInstances *) pthread_getspecific(s_threadKey);
+}
+
+static void setThreadInstances(ThreadInstances * list)
+{
+    pthread_setspecific(s_threadKey, list);
+}
+
+typedef pthread_t ThreadId;
+
+static ThreadId currentThread()
+{
+    return pthread_self();
+}
+
+static bool sameThread(ThreadId a, ThreadId b)
+{
+    return pthread_equal(a, b) != 0;
+}
+#endif
+
+// every instance in the process, for totals.  instances live on other
+// threads' isolates, so this is the one piece of state they share
+static struct
+{
+    uv_once_t once;
+    uv_mutex_t lock;
+    vector<memwatch::Instance *> instances;
+    // the thread that runs the loop instances are given, the first to load
+    // us.  in node that's the main thread, other threads can only be
+    // started from there
+    bool loopClaimed;
+    ThreadId loopThread;
+} s_registry = { UV_ONCE_INIT };
+
+static void initRegistry()
+{
+    uv_mutex_init(&s_registry.lock);
+    initThreadKey();
+}
+
+// a thread's isolates go with it, so its instances stop counting toward
+// totals.  they aren't freed: their handles may still be linked into the
+// loop they were given, which can outlive the thread
+static void releaseThread(void * arg)
+{
+    ThreadInstances * mine = (ThreadInstances *) arg;
+    if (!mine) return;
+
+    uv_mutex_lock(&s_registry.lock);
+    vector<memwatch::Instance *> & all = s_registry.instances;
+    for (size_t i = 0; i < mine->size(); i++) {
+        all.erase(remove(all.begin(), all.end(), (*mine)[i]), all.end());
+    }
+    uv_mutex_unlock(&s_registry.lock);
+
+    delete mine;
+}
+
+memwatch::Instance::Instance(Isolate * isolate, uv_loop_t * loop)
+    : isolate(isolate), loop(loop), used(0), total(0), external(0)
+{
+    slot.tag = SLOT_TAG;
+    slot.instance = this;
+}
+
+memwatch::Instance *
+memwatch::Instance::current()
+{
+    Slot * slot = (Slot *) Isolate::GetCurrent()->GetData();
+    return slot && slot->tag == SLOT_TAG ? slot->instance : NULL;
+}
+
+memwatch::Instance *
+memwatch::Instance::create(uv_loop_t * loop, bool & fresh)
+{
+    fresh = false;
+    Isolate * isolate = Isolate::GetCurrent();
+    if (isolate->GetData()) return current();
+
+    uv_once(&s_registry.once, initRegistry);
+    uv_mutex_lock(&s_registry.lock);
+    if (!s_registry.loopClaimed) {
+        s_registry.loopClaimed = true;
+        s_registry.loopThread = currentThread();
+    }
+    // a loop belongs to its thread.  libuv handles and javascript calls
+    // from any other would race it, so isolates elsewhere go without
+    if (!sameThread(s_registry.loopThread, currentThread())) loop = NULL;
+
+    // instances last as long as their isolate, which for node is as long
+    // as the thread it runs on
+    Instance * instance = new Instance(isolate, loop);
+    isolate->SetData(&instance->slot);
+    fresh = true;
+
+    s_registry.instances.push_back(instance);
+    uv_mutex_unlock(&s_registry.lock);
+
+    ThreadInstances * mine = threadInstances();
+    if (!mine) {
+        mine = new ThreadInstances;
+        setThreadInstances(mine);
+    }
+    mine->push_back(instance);
+
+    return instance;
+}
+
+Handle<Value>
+memwatch::Instance::offLoop(const char * what)
+{
+    std::string msg = std::string("memwatch: ") + what +
+        " needs node's event loop, which this isolate's thread doesn't run";
+    return ThrowException(Exception::Error(String::New(msg.c_str())));
+}
+
+Handle<Value>
+memwatch::Instance::missing()
+{
+    return ThrowException(Exception::Error(String::New(
+        "memwatch has lost this isolate's data slot to another addon")));
+}
+
+void
+memwatch::Instance::publish(uint64_t used, uint64_t total, uint64_t external)
+{
+    uv_mutex_lock(&s_registry.lock);
+    this->used = used;
+    this->total = total;
+    this->external = external;
+    uv_mutex_unlock(&s_registry.lock);
+}
+
+void
+memwatch::totals(Totals & t)
+{
+    t.isolates = 0;
+    t.used = t.total = t.external = 0;
+
+    uv_once(&s_registry.once, initRegistry);
+    uv_mutex_lock(&s_registry.lock);
+    for (size_t i = 0; i < s_registry.instances.size(); i++) {
+        const Instance * instance = s_registry.instances[i];
+        t.isolates++;
+        t.used += instance->used;
+        t.total += instance->total;
+        t.external += instance->external;
+    }
+    uv_mutex_unlock(&s_registry.lock);
+}
@@ -0,0 +1,92 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __INSTANCE_HH
+#define __INSTANCE_HH
+
+#include "census.hh"
+#include "gcstats.hh"
+#include "heapdiff.hh"
+#include "memwatch.hh"
+
+#include <node.h>
+
+#include <stdint.h>
+
+namespace memwatch
+{
+    struct Totals;
+
+    // all of memwatch's state for one isolate.  each isolate has its own
+    // heap, so each gets its own stats, its own event loop wakeups and its
+    // own javascript callback.  the instance hangs off of the isolate
+    // (Isolate::SetData()) so gc callbacks, which are handed no user data,
+    // can find it.
+    class Instance
+    {
+      public:
+        // the instance for the isolate we're running in, NULL if memwatch
+        // hasn't been loaded into it or another addon has since taken the
+        // isolate's data slot
+        static Instance * current();
+
+        // the instance for the current isolate, posting events to loop.
+        // only the thread that loads us first gets the loop, see loop
+        // below.  fresh is set when it's made now rather than by an earlier
+        // load.  returns NULL if another addon holds the isolate's data slot
+        static Instance * create(uv_loop_t * loop, bool & fresh);
+
+        // throws, for natives called where current() is NULL
+        static v8::Handle<v8::Value> missing();
+        // throws, for natives that need loop where it's NULL
+        static v8::Handle<v8::Value> offLoop(const char * what);
+
+        // record this isolate's heap for the process-wide totals
+        void publish(uint64_t used, uint64_t total, uint64_t external);
+
+        v8::Isolate * isolate;
+        // NULL for isolates on threads that don't run the loop we were
+        // given.  they get stats and diffs on demand, but no events and no
+        // work on the thread pool
+        uv_loop_t * loop;
+
+        State watch;
+        gcstats::State pauses;
+        census::State census;
+        heapdiff::State diff;
+
+      private:
+        Instance(v8::Isolate * isolate, uv_loop_t * loop);
+        Instance(const Instance &);
+        Instance & operator=(const Instance &);
+
+        // what we put in the isolate's one data slot.  the tag tells it
+        // apart from whatever another addon or the embedder puts there
+        struct Slot
+        {
+            uint32_t tag;
+            Instance * instance;
+        };
+        Slot slot;
+
+        // guarded by the registry lock
+        uint64_t used, total, external;
+
+        friend void totals(Totals & t);
+    };
+
+    // the heap across every isolate that has loaded memwatch, as of each
+    // one's last compaction
+    struct Totals
+    {
+        unsigned int isolates;
+        uint64_t used;
+        uint64_t total;
+        uint64_t external;
+    };
+
+    void totals(Totals & t);
+};
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "leakdetector.hh"
+
+#include <math.h> // exp(), fabs(), sqrt()
+
+using namespace leakdetector;
+
+// the standard normal cdf, abramowitz and stegun 7.1.26 (good to 1e-7)
+static double normalCdf(double z)
+{
+    double x = fabs(z) / sqrt(2.0);
+    double t = 1.0 / (1.0 + 0.3275911 * x);
+    double erf = 1.0 - t * (0.254829592 + t * (-0.284496736 + t * (1.421413741 +
+                 t * (-1.453152027 + t * 1.061405429)))) * exp(-x * x);
+    return z < 0 ? 0.5 * (1.0 - erf) : 0.5 * (1.0 + erf);
+}
+
+// how sure we are that a value with this standard error is above zero
+static double positive(double value, double error)
+{
+    if (error > 0) return normalCdf(value / error);
+    return value > 0 ? 1 : 0;
+}
+
+// the same from a student t with dof degrees of freedom, which a handful
+// of points in a window calls for.  the t is mapped onto a normal with
+// abramowitz and stegun 26.7.8, within a percent or so for dof >= 3
+static double positive(double value, double error, unsigned int dof)
+{
+    if (!(error > 0)) return value > 0 ? 1 : 0;
+    double t = value / error;
+    double z = t * (1 - 1 / (4.0 * dof)) / sqrt(1 + t * t / (2.0 * dof));
+    return normalCdf(z);
+}
+
+static inline double minimum(double a, double b)
+{
+    return a < b ? a : b;
+}
+
+RegressionDetector::RegressionDetector()
+    : window(Options().window)
+{
+    reset();
+}
+
+void
+RegressionDetector::configure(const Options & options)
+{
+    window = options.window;
+    if (window < 3) window = 3;
+    if (window > MAX_WINDOW) window = MAX_WINDOW;
+    reset();
+}
+
+void
+RegressionDetector::reset()
+{
+    first = len = 0;
+    origin = 0;
+    trend = heaphistory::Trend();
+}
+
+bool
+RegressionDetector::observe(const Observation & o)
+{
+    if (!len) origin = o.time;
+
+    if (len == window) {
+        const Observation & old = samples[first];
+        trend.remove(old.time - origin, old.used);
+        first = (first + 1) % MAX_WINDOW;
+        len--;
+
+        // keep x small by measuring from the oldest sample
+        double next = samples[first].time;
+        trend.shift(next - origin);
+        origin = next;
+    }
+
+    samples[(first + len) % MAX_WINDOW] = o;
+    trend.add(o.time - origin, o.used);
+    len++;
+    return false;
+}
+
+void
+RegressionDetector::judge(Verdict & v) const
+{
+    if (len < 3) {
+        v.confidence = 0;
+        return;
+    }
+
+    const Observation & oldest = samples[first];
+    const Observation & newest = samples[(first + len - 1) % MAX_WINDOW];
+
+    v.slope = trend.slope();
+    v.confidence = minimum(v.confidence,
+                           positive(v.slope, trend.slopeError(), len - 2));
+    v.start = oldest.time;
+    v.growth = v.slope * (newest.time - oldest.time);
+    v.samples = len;
+}
+
+HoltDetector::HoltDetector()
+    : alpha(Options().alpha), beta(Options().beta)
+{
+    reset();
+}
+
+void
+HoltDetector::configure(const Options & options)
+{
+    alpha = options.alpha;
+    beta = options.beta;
+    reset();
+}
+
+void
+HoltDetector::reset()
+{
+    n = 0;
+    lastTime = level = trend = variance = interval = 0;
+}
+
+bool
+HoltDetector::observe(const Observation & o)
+{
+    if (!n) {
+        level = o.used;
+        lastTime = o.time;
+        n = 1;
+        return false;
+    }
+
+    double dt = o.time - lastTime;
+    if (dt <= 0) dt = 1e-3;
+
+    double forecast = level + trend * dt;
+    double error = o.used - forecast;
+
+    if (n == 1) {
+        // two points, all we can do is draw a line through them
+        trend = (o.used - level) / dt;
+        level = o.used;
+        interval = dt;
+    } else {
+        double next = alpha * o.used + (1 - alpha) * forecast;
+        trend = beta * (next - level) / dt + (1 - beta) * trend;
+        level = next;
+        variance = (n == 2) ? error * error
+                            : (1 - alpha) * variance + alpha * error * error;
+        interval = (1 - beta) * interval + beta * dt;
+    }
+
+    lastTime = o.time;
+    n++;
+    return false;
+}
+
+void
+HoltDetector::judge(Verdict & v) const
+{
+    if (n < 3) {
+        v.confidence = 0;
+        return;
+    }
+
+    // the regression speaks for the whole window, we only speak up when
+    // growth seems to have stopped lately.  the trend is an exponentially
+    // weighted average of noisy slopes, its spread shrinks with beta
+    if (trend > 0) return;
+    double error = interval > 0
+        ? sqrt(variance) / interval * sqrt(beta / (2 - beta)) : 0;
+    v.confidence = minimum(v.confidence, positive(trend, error));
+}
+
+ChangePointDetector::ChangePointDetector()
+    : threshold(Options().changeThreshold)
+{
+    reset();
+}
+
+void
+ChangePointDetector::configure(const Options & options)
+{
+    threshold = options.changeThreshold;
+    reset();
+}
+
+void
+ChangePointDetector::reset()
+{
+    n = 0;
+    last = mean = variance = high = low = 0;
+}
+
+bool
+ChangePointDetector::observe(const Observation & o)
+{
+    if (!n) {
+        last = o.used;
+        n = 1;
+        return false;
+    }
+
+    double delta = o.used - last;
+    last = o.used;
+
+    // don't judge until we have an idea what a normal change looks like
+    unsigned int seen = n - 1;
+    if (seen >= 4 && variance > 0) {
+        double z = (delta - mean) / sqrt(variance / (seen - 1));
+        // half a standard deviation of slack either way
+        high = high + z - 0.5 > 0 ? high + z - 0.5 : 0;
+        low = low - z - 0.5 > 0 ? low - z - 0.5 : 0;
+        if (high > threshold || low > threshold) {
+            reset();
+            last = o.used;
+            n = 1;
+            return true;
+        }
+    }
+
+    // welford's running mean and sum of squares over this regime
+    seen++;
+    double before = mean;
+    mean += (delta - mean) / seen;
+    variance += (delta - before) * (delta - mean);
+    n++;
+    return false;
+}
+
+Engine::Engine()
+    : observed(0), samples(0), agreed(0), fresh(true)
+{
+    add(new RegressionDetector);
+    add(new HoltDetector);
+    add(new ChangePointDetector);
+}
+
+Engine::~Engine()
+{
+    for (size_t i = 0; i < detectors.size(); i++) delete detectors[i];
+}
+
+void
+Engine::configure(const Options & options)
+{
+    opts = options;
+    for (size_t i = 0; i < detectors.size(); i++) detectors[i]->configure(opts);
+    samples = agreed = 0;
+}
+
+void
+Engine::add(Detector * d)
+{
+    d->configure(opts);
+    detectors.push_back(d);
+}
+
+void
+Engine::reset()
+{
+    for (size_t i = 0; i < detectors.size(); i++) detectors[i]->reset();
+    samples = agreed = 0;
+}
+
+bool
+Engine::observe(const Observation & o, Verdict & v)
+{
+    if (++observed <= opts.warmup) return false;
+
+    fresh = (samples == 0);
+
+    bool changed = false;
+    for (size_t i = 0; i < detectors.size(); i++) {
+        if (detectors[i]->observe(o)) changed = true;
+    }
+
+    // a new regime, start everyone over from this observation
+    if (changed) {
+        for (size_t i = 0; i < detectors.size(); i++) {
+            detectors[i]->reset();
+            detectors[i]->observe(o);
+        }
+        samples = agreed = 0;
+        fresh = true;
+    }
+
+    if (++samples < opts.minSamples) return false;
+
+    v = Verdict();
+    for (size_t i = 0; i < detectors.size(); i++) detectors[i]->judge(v);
+
+    if (v.slope > 0 && o.limit > o.used) {
+        v.timeToOOM = (o.limit - o.used) / v.slope;
+    }
+    // noise wanders over the line and straight back, a leak stays
+    bool agree = v.slope > 0 && v.confidence >= opts.confidence;
+    agreed = agree ? agreed + 1 : 0;
+    v.leaking = agree && agreed >= opts.confirm;
+    return v.leaking;
+}
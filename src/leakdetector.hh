@@ -0,0 +1,198 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __LEAKDETECTOR_HH
+#define __LEAKDETECTOR_HH
+
+#include "heaphistory.hh"
+
+#include <vector>
+
+// deciding whether post-GC heap usage is growing for real.  a handful of
+// detectors each watch the baseline after every compaction and have a say
+// in the verdict; the engine runs them, restarts them all when one of them
+// sees the heap's behaviour change, and calls a leak once they agree.
+// every step is O(1) over a bounded window.
+namespace leakdetector
+{
+    struct Options
+    {
+        Options()
+            : warmup(10), window(60), minSamples(10), confirm(10),
+              confidence(0.99), alpha(0.3), beta(0.1), changeThreshold(5) { }
+
+        // compactions to ignore at startup, while caches and the like fill
+        unsigned int warmup;
+        // compactions the regression looks back over (at most MAX_WINDOW)
+        unsigned int window;
+        // compactions to watch after a (re)start before calling anything
+        unsigned int minSamples;
+        // compactions in a row the detectors must agree before we call it.
+        // the window slides every compaction, so one agreement is one of
+        // thousands of looks at the same noise
+        unsigned int confirm;
+        // how sure we must be the heap is growing, strictly 0 to 1
+        double confidence;
+        // smoothing for the level and trend of holt's method, strictly 0
+        // to 1
+        double alpha;
+        double beta;
+        // how far, in standard deviations, the cumulative change in growth
+        // rate must drift before we call it a new regime
+        double changeThreshold;
+    };
+
+    static const unsigned int MAX_WINDOW = 128;
+
+    // one post-GC measurement.  time is in seconds from any fixed point
+    struct Observation
+    {
+        double time;
+        double used;
+        double limit;
+    };
+
+    struct Verdict
+    {
+        Verdict()
+            : leaking(false), slope(0), confidence(1), timeToOOM(-1),
+              start(0), growth(0), samples(0) { }
+
+        bool leaking;
+        // bytes per second
+        double slope;
+        // that the heap really is growing, 0 to 1
+        double confidence;
+        // seconds until used reaches the limit at this rate, -1 if never
+        double timeToOOM;
+        // when the evidence starts, and the growth since then
+        double start;
+        double growth;
+        unsigned int samples;
+    };
+
+    class Detector
+    {
+      public:
+        virtual ~Detector() { }
+
+        virtual void configure(const Options & options) = 0;
+        virtual void reset() = 0;
+        // returns true if the heap's behaviour just changed, which
+        // restarts every detector
+        virtual bool observe(const Observation & o) = 0;
+        // add what this detector knows to the verdict
+        virtual void judge(Verdict & v) const = 0;
+    };
+
+    // a least squares fit of usage against time over the last window
+    // compactions.  sets the slope, the growth, and the confidence that
+    // the slope is positive, from its t statistic
+    class RegressionDetector : public Detector
+    {
+      public:
+        RegressionDetector();
+
+        void configure(const Options & options);
+        void reset();
+        bool observe(const Observation & o);
+        void judge(Verdict & v) const;
+
+      private:
+        unsigned int window;
+        Observation samples[MAX_WINDOW];
+        unsigned int first;
+        unsigned int len;
+        // x is time relative to the oldest sample in the window
+        double origin;
+        heaphistory::Trend trend;
+    };
+
+    // holt's linear method: exponentially smoothed level and trend.  it
+    // reacts faster than the regression and forgets old behaviour, so it
+    // vetoes a leak when a warm-up or cache fill has levelled off but the
+    // window still remembers the climb
+    class HoltDetector : public Detector
+    {
+      public:
+        HoltDetector();
+
+        void configure(const Options & options);
+        void reset();
+        bool observe(const Observation & o);
+        void judge(Verdict & v) const;
+
+      private:
+        double alpha, beta;
+        unsigned int n;
+        double lastTime;
+        double level;
+        // bytes per second
+        double trend;
+        // smoothed squared error of our one step forecasts
+        double variance;
+        double interval;
+    };
+
+    // a two sided CUSUM over the change in usage between compactions.
+    // when growth speeds up, slows down or stops, what came before says
+    // nothing about what happens next
+    class ChangePointDetector : public Detector
+    {
+      public:
+        ChangePointDetector();
+
+        void configure(const Options & options);
+        void reset();
+        bool observe(const Observation & o);
+        void judge(Verdict &) const { }
+
+      private:
+        double threshold;
+        unsigned int n;
+        double last;
+        double mean;
+        double variance;
+        double high, low;
+    };
+
+    class Engine
+    {
+      public:
+        // starts with the regression, holt and change point detectors
+        Engine();
+        ~Engine();
+
+        void configure(const Options & options);
+        const Options & options() const { return opts; }
+
+        // takes ownership
+        void add(Detector * d);
+
+        // forget everything, as after a leak has been reported
+        void reset();
+
+        // returns true, and fills in v, when the detectors agree the heap
+        // is leaking
+        bool observe(const Observation & o, Verdict & v);
+
+        // true if the last observation started a new window of evidence
+        bool restarted() const { return fresh; }
+
+      private:
+        Engine(const Engine &);
+        Engine & operator=(const Engine &);
+
+        Options opts;
+        std::vector<Detector *> detectors;
+        // observations ever made, and since the last (re)start
+        unsigned int observed;
+        unsigned int samples;
+        // verdicts in a row that found a leak
+        unsigned int agreed;
+        bool fresh;
+    };
+};
+
+#endif
@@ -4,7 +4,13 @@
 
 #include "platformcompat.hh"
 #include "memwatch.hh"
+#include "census.hh"
+#include "gcstats.hh"
 #include "heapdiff.hh"
+#include "heaphistory.hh"
+#include "instance.hh"
+#include "leakdetector.hh"
+#include "nativemem.hh"
 #include "util.hh"
 
 #include <node.h>
@@ -20,228 +26,461 @@
 using namespace v8;
 using namespace node;
 
-Handle<Object> g_context;
-Handle<Function> g_cb;
-
-struct Baton {
-    uv_work_t req;
-    size_t heapUsage;
-    GCType type;
-    GCCallbackFlags flags;
-};
+using memwatch::GCRecord;
+using memwatch::Instance;
+using memwatch::Ring;
+using memwatch::State;
 
 static const unsigned int RECENT_PERIOD = 10;
 static const unsigned int ANCIENT_PERIOD = 120;
 
-static struct
+memwatch::State::State()
+    : statsListeners(false), leakListeners(false), watchNative(true)
 {
-    // counts of different types of gc events
-    unsigned int gc_full;
-    unsigned int gc_inc;
-    unsigned int gc_compact;
-
-    // last base heap size as measured *right* after GC
-    unsigned int last_base;
-
-    // the estimated "base memory" usage of the javascript heap
-    // over the RECENT_PERIOD number of GC runs
-    unsigned int base_recent;
+    memset(&ring, 0, sizeof(ring));
+    memset(&stats, 0, sizeof(stats));
+}
 
-    // the estimated "base memory" usage of the javascript heap
-    // over the ANCIENT_PERIOD number of GC runs
-    unsigned int base_ancient;
+static Persistent<String> symbol(const char * str)
+{
+    return Persistent<String>::New(String::NewSymbol(str));
+}
 
-    // the most extreme values we've seen for base heap size
-    unsigned int base_max;
-    unsigned int base_min;
+static void initKeys(memwatch::Keys & key)
+{
+    HandleScope scope;
 
-    // leak detection!
+    key.stats = symbol("stats");
+    key.leak = symbol("leak");
+
+    key.num_full_gc = symbol("num_full_gc");
+    key.num_inc_gc = symbol("num_inc_gc");
+    key.heap_compactions = symbol("heap_compactions");
+    key.usage_trend = symbol("usage_trend");
+    key.estimated_base = symbol("estimated_base");
+    key.current_base = symbol("current_base");
+    key.min = symbol("min");
+    key.max = symbol("max");
+    key.compactions_since_last = symbol("compactions_since_last");
+    key.min_since_last = symbol("min_since_last");
+    key.max_since_last = symbol("max_since_last");
+    key.dropped_since_last = symbol("dropped_since_last");
+    key.pause = symbol("pause");
+    key.heap = symbol("heap");
+
+    Handle<String> statsKeys[] = {
+        key.num_full_gc, key.num_inc_gc, key.heap_compactions,
+        key.usage_trend, key.estimated_base, key.current_base, key.min,
+        key.max, key.compactions_since_last, key.min_since_last,
+        key.max_since_last, key.dropped_since_last, key.pause, key.heap
+    };
+    Local<ObjectTemplate> t = ObjectTemplate::New();
+    for (size_t i = 0; i < sizeof(statsKeys) / sizeof(statsKeys[0]); i++) {
+        t->Set(statsKeys[i], Undefined());
+    }
+    key.statsTemplate = Persistent<ObjectTemplate>::New(t);
 
-    // the period from which this leak analysis starts
-    time_t leak_time_start;
-    // the base memory for the detection period
-    time_t leak_base_start;
-    // the number of consecutive compactions for which we've grown
-    unsigned int consecutive_growth;
-} s_stats;
+    for (int i = 0; i < heaphistory::kSeriesCount; i++) {
+        key.series[i] = symbol(heaphistory::seriesName((heaphistory::Series) i));
+    }
+    key.limit = symbol("limit");
+    key.fragmentation = symbol("fragmentation");
+    key.trend = symbol("trend");
+    key.samples = symbol("samples");
+}
 
-static Handle<Value> getLeakReport(size_t heapUsage)
+// native is true for growth outside of the javascript heap, which no
+// census can explain
+static Handle<Value> getLeakReport(State & st, const GCRecord & r,
+                                   const leakdetector::Verdict & v, bool native)
 {
     HandleScope scope;
 
-    size_t growth = heapUsage - s_stats.leak_base_start;
-    int now = time(NULL);
-    int delta = now - s_stats.leak_time_start;
+    // the verdict is in monotonic time, the report in wall clock time
+    time_t now = time(NULL);
+    time_t start = now - (time_t) (r.time - v.start);
+    int64_t delta = now - start;
 
     Local<Object> leakReport = Object::New();
-    leakReport->Set(String::New("start"), NODE_UNIXTIME_V8(s_stats.leak_time_start));
+    leakReport->Set(String::New("kind"), String::New(native ? "native" : "heap"));
+    leakReport->Set(String::New("start"), NODE_UNIXTIME_V8(start));
     leakReport->Set(String::New("end"), NODE_UNIXTIME_V8(now));
-    leakReport->Set(String::New("growth"), Integer::New(growth));
+    leakReport->Set(String::New("growth"), Number::New(ROUND(v.growth)));
+    leakReport->Set(String::New("slope"), Number::New(v.slope));
+    leakReport->Set(String::New("confidence"), Number::New(v.confidence));
+    leakReport->Set(String::New("time_to_oom"),
+                    v.timeToOOM < 0 ? (Handle<Value>) Null()
+                                    : (Handle<Value>) Number::New(ROUND(v.timeToOOM)));
 
     std::stringstream ss;
-    ss << "heap growth over 5 consecutive GCs ("
+    ss << (native ? "native memory" : "heap") << " growth over " << v.samples << " GCs ("
        << mw_util::niceDelta(delta) << ") - "
-       << mw_util::niceSize(growth / ((double) delta / (60.0 * 60.0))) << "/hr";
+       << mw_util::niceSize(v.slope * 60.0 * 60.0) << "/hr, "
+       << (int) (v.confidence * 100.0) << "% confidence";
 
     leakReport->Set(String::New("reason"), String::New(ss.str().c_str()));
+    if (native) return scope.Close(leakReport);
+
+    // what grew, if we've been sampling.  this compaction isn't counted
+    // yet, hence the + 1
+    Handle<Value> growing = census::growing_types(st.stats.gc_compact + 1);
+    if (!growing.IsEmpty()) leakReport->Set(String::New("growing"), growing);
 
     return scope.Close(leakReport);
 }
 
-static void AsyncMemwatchAfter(uv_work_t* request) {
+static bool isCompaction(const GCRecord & r)
+{
+    return
+#if NODE_VERSION_AT_LEAST(0,8,0)
+        r.type == kGCTypeMarkSweepCompact
+#else
+        r.flags == kGCCallbackFlagCompacted
+#endif
+        ;
+}
+
+static void recordHeap(Instance & instance, const GCRecord & r)
+{
+    heaphistory::Sample s;
+    s.time = time(NULL);
+    s.values[heaphistory::kUsed] = r.heapUsage;
+    s.values[heaphistory::kTotal] = r.heapTotal;
+    s.values[heaphistory::kExecutable] = r.heapExecutable;
+    s.values[heaphistory::kExternal] = r.external;
+    s.values[heaphistory::kUnused] = r.heapTotal > r.heapUsage ? r.heapTotal - r.heapUsage : 0;
+    s.values[heaphistory::kRss] = r.native.rss;
+    s.values[heaphistory::kMalloc] = r.native.malloced;
+    s.limit = r.heapLimit;
+    instance.watch.history.push(s);
+    instance.publish(r.heapUsage, r.heapTotal, r.external);
+}
+
+// the latest heap figures and how each is trending, in bytes per
+// compaction
+static Handle<Value> heapToObject(const State & st)
+{
     HandleScope scope;
+    const memwatch::Keys & key = st.keys;
+    const heaphistory::History & history = st.history;
+
+    Local<Object> heap = Object::New();
+    if (!history.size()) return scope.Close(heap);
+
+    const heaphistory::Sample & s = history.latest();
+    Local<Object> trend = Object::New();
+    for (int i = 0; i < heaphistory::kSeriesCount; i++) {
+        heaphistory::Series series = (heaphistory::Series) i;
+        heap->Set(key.series[i], Number::New((double) s.values[i]));
+        trend->Set(key.series[i], Number::New(ROUND(history.slope(series))));
+    }
+    heap->Set(key.limit, Number::New((double) s.limit));
+    double fragmentation = 0;
+    if (s.values[heaphistory::kTotal]) {
+        fragmentation = ROUND((double) s.values[heaphistory::kUnused] /
+                              (double) s.values[heaphistory::kTotal] * 1000.0) / 10.0;
+    }
+    heap->Set(key.fragmentation, Number::New(fragmentation));
+    heap->Set(key.trend, trend);
+    heap->Set(key.samples, Integer::New(history.size()));
 
-    Baton * b = (Baton *) request->data;
+    return scope.Close(heap);
+}
 
-    // do the math in C++, permanent
-    // record the type of GC event that occured
-    if (b->type == kGCTypeMarkSweepCompact) s_stats.gc_full++;
-    else s_stats.gc_inc++;
+static void processCompaction(Instance & instance, const GCRecord & r)
+{
+    State & st = instance.watch;
 
-    if (
-#if NODE_VERSION_AT_LEAST(0,8,0)
-        b->type == kGCTypeMarkSweepCompact
-#else
-        b->flags == kGCCallbackFlagCompacted
-#endif
-        ) {
-        // leak detection code.  has the heap usage grown?
-        if (s_stats.last_base < b->heapUsage) {
-            if (s_stats.consecutive_growth == 0) {
-                s_stats.leak_time_start = time(NULL);
-                s_stats.leak_base_start = b->heapUsage;
-            }
+    recordHeap(instance, r);
 
-            s_stats.consecutive_growth++;
+    // leak detection code.  is the heap growing, for real?
+    leakdetector::Observation o;
+    o.time = r.time;
+    o.used = r.heapUsage;
+    o.limit = r.heapLimit;
 
-            // consecutive growth over 5 GCs suggests a leak
-            if (s_stats.consecutive_growth >= 5) {
-                // reset to zero
-                s_stats.consecutive_growth = 0;
+    leakdetector::Verdict v;
+    bool leaking = st.detector.observe(o, v);
 
-                // emit a leak report!
-                Handle<Value> argv[3];
-                argv[0] = Boolean::New(false);
-                // the type of event to emit
-                argv[1] = String::New("leak");
-                argv[2] = getLeakReport(b->heapUsage);
-                g_cb->Call(g_context, 3, argv);
-            }
-        } else {
-            s_stats.consecutive_growth = 0;
-        }
+    // the evidence starts here, so does the census we'll compare against
+    if (st.detector.restarted()) census::growth_started();
 
-        // update last_base
-        s_stats.last_base = b->heapUsage;
-
-        // update compaction count
-        s_stats.gc_compact++;
-
-        // the first ten compactions we'll use a different algorithm to
-        // dampen out wider memory fluctuation at startup
-        if (s_stats.gc_compact < RECENT_PERIOD) {
-            double decay = pow(s_stats.gc_compact / RECENT_PERIOD, 2.5);
-            decay *= s_stats.gc_compact;
-            if (ISINF(decay) || ISNAN(decay)) decay = 0;
-            s_stats.base_recent = ((s_stats.base_recent * decay) +
-                                   s_stats.last_base) / (decay + 1);
-
-            decay = pow(s_stats.gc_compact / RECENT_PERIOD, 2.4);
-            decay *= s_stats.gc_compact;
-            s_stats.base_ancient = ((s_stats.base_ancient * decay) +
-                                    s_stats.last_base) /  (1 + decay);
-
-        } else {
-            s_stats.base_recent = ((s_stats.base_recent * (RECENT_PERIOD - 1)) +
-                                   s_stats.last_base) / RECENT_PERIOD;
-            double decay = FMIN(ANCIENT_PERIOD, s_stats.gc_compact);
-            s_stats.base_ancient = ((s_stats.base_ancient * (decay - 1)) +
-                                    s_stats.last_base) / decay;
+    if (leaking) {
+        // the next report needs evidence of its own
+        st.detector.reset();
+
+        // emit a leak report!  but only build one if it'll be heard
+        if (st.leakListeners && !st.cb.IsEmpty()) {
+            Handle<Value> argv[2];
+            // the type of event to emit
+            argv[0] = st.keys.leak;
+            argv[1] = getLeakReport(st, r, v, false);
+            st.cb->Call(st.context, 2, argv);
         }
+    }
 
-        // only record min/max after 3 gcs to let initial instability settle
-        if (s_stats.gc_compact >= 3) {
-            if (!s_stats.base_min || s_stats.base_min > s_stats.last_base) {
-                s_stats.base_min = s_stats.last_base;
+    // and the same again for memory outside the heap, which has no limit
+    // we know of
+    if (st.watchNative) {
+        o.used = (double) nativemem::footprint(r.native, r.heapTotal,
+                                               r.external > 0 ? r.external : 0);
+        o.limit = 0;
+        leakdetector::Verdict nv;
+        if (st.nativeDetector.observe(o, nv)) {
+            st.nativeDetector.reset();
+            if (st.leakListeners && !st.cb.IsEmpty()) {
+                Handle<Value> argv[2];
+                argv[0] = st.keys.leak;
+                argv[1] = getLeakReport(st, r, nv, true);
+                st.cb->Call(st.context, 2, argv);
             }
+        }
+    }
 
-            if (!s_stats.base_max || s_stats.base_max < s_stats.last_base) {
-                s_stats.base_max = s_stats.last_base;
-            }
+    // update last_base
+    st.stats.last_base = r.heapUsage;
+
+    // fold this compaction into the next stats event
+    memwatch::Emission & e = st.emission;
+    if (!e.compactions || r.heapUsage < e.min) e.min = r.heapUsage;
+    if (!e.compactions || r.heapUsage > e.max) e.max = r.heapUsage;
+    e.compactions++;
+
+    // update compaction count
+    st.stats.gc_compact++;
+
+    census::sample(st.stats.gc_compact);
+
+    // the first ten compactions we'll use a different algorithm to
+    // dampen out wider memory fluctuation at startup
+    if (st.stats.gc_compact < RECENT_PERIOD) {
+        double decay = pow(st.stats.gc_compact / RECENT_PERIOD, 2.5);
+        decay *= st.stats.gc_compact;
+        if (ISINF(decay) || ISNAN(decay)) decay = 0;
+        st.stats.base_recent = ((st.stats.base_recent * decay) +
+                               st.stats.last_base) / (decay + 1);
+
+        decay = pow(st.stats.gc_compact / RECENT_PERIOD, 2.4);
+        decay *= st.stats.gc_compact;
+        st.stats.base_ancient = ((st.stats.base_ancient * decay) +
+                                st.stats.last_base) /  (1 + decay);
+
+    } else {
+        st.stats.base_recent = ((st.stats.base_recent * (RECENT_PERIOD - 1)) +
+                               st.stats.last_base) / RECENT_PERIOD;
+        double decay = FMIN(ANCIENT_PERIOD, st.stats.gc_compact);
+        st.stats.base_ancient = ((st.stats.base_ancient * (decay - 1)) +
+                                st.stats.last_base) / decay;
+    }
+
+    // only record min/max after 3 gcs to let initial instability settle
+    if (st.stats.gc_compact >= 3) {
+        if (!st.stats.base_min || st.stats.base_min > st.stats.last_base) {
+            st.stats.base_min = st.stats.last_base;
         }
 
-        // if there are any listeners, it's time to emit!
-        if (!g_cb.IsEmpty()) {
-            Handle<Value> argv[3];
-            // magic argument to indicate to the callback all we want to know is whether there are
-            // listeners (here we don't)
-            argv[0] = Boolean::New(true);
-
-            Handle<Value> haveListeners = g_cb->Call(g_context, 1, argv);
-
-            if (haveListeners->BooleanValue()) {
-                double ut= 0.0;
-                if (s_stats.base_ancient) {
-                    ut = (double) ROUND(((double) (s_stats.base_recent - s_stats.base_ancient) /
-                                         (double) s_stats.base_ancient) * 1000.0) / 10.0;
-                }
-
-                // ok, there are listeners, we actually must serialize and emit this stats event
-                Local<Object> stats = Object::New();
-                stats->Set(String::New("num_full_gc"), Integer::New(s_stats.gc_full));
-                stats->Set(String::New("num_inc_gc"), Integer::New(s_stats.gc_inc));
-                stats->Set(String::New("heap_compactions"), Integer::New(s_stats.gc_compact));
-                stats->Set(String::New("usage_trend"), Number::New(ut));
-                stats->Set(String::New("estimated_base"), Integer::New(s_stats.base_recent));
-                stats->Set(String::New("current_base"), Integer::New(s_stats.last_base));
-                stats->Set(String::New("min"), Integer::New(s_stats.base_min));
-                stats->Set(String::New("max"), Integer::New(s_stats.base_max));
-                argv[0] = Boolean::New(false);
-                // the type of event to emit
-                argv[1] = String::New("stats");
-                argv[2] = stats;
-                g_cb->Call(g_context, 3, argv);
+        if (!st.stats.base_max || st.stats.base_max < st.stats.last_base) {
+            st.stats.base_max = st.stats.last_base;
+        }
+    }
+}
+
+static void emitStats(State & st)
+{
+    HandleScope scope;
+    const memwatch::Keys & key = st.keys;
+    memwatch::Emission & e = st.emission;
+
+    double ut= 0.0;
+    if (st.stats.base_ancient) {
+        // in doubles, the difference of two unsigned sizes can be negative
+        ut = (double) ROUND((((double) st.stats.base_recent - (double) st.stats.base_ancient) /
+                             (double) st.stats.base_ancient) * 1000.0) / 10.0;
+    }
+
+    // ok, there are listeners, we actually must serialize and emit this stats event
+    Local<Object> stats = key.statsTemplate->NewInstance();
+    stats->Set(key.num_full_gc, Number::New((double) st.stats.gc_full));
+    stats->Set(key.num_inc_gc, Number::New((double) st.stats.gc_inc));
+    stats->Set(key.heap_compactions, Number::New((double) st.stats.gc_compact));
+    stats->Set(key.usage_trend, Number::New(ut));
+    stats->Set(key.estimated_base, Number::New((double) st.stats.base_recent));
+    stats->Set(key.current_base, Number::New((double) st.stats.last_base));
+    stats->Set(key.min, Number::New((double) st.stats.base_min));
+    stats->Set(key.max, Number::New((double) st.stats.base_max));
+    stats->Set(key.compactions_since_last, Number::New((double) e.compactions));
+    stats->Set(key.min_since_last, Number::New((double) e.min));
+    stats->Set(key.max_since_last, Number::New((double) e.max));
+    stats->Set(key.dropped_since_last, Number::New((double) st.ring.dropped));
+    stats->Set(key.pause, gcstats::toObject(true));
+    stats->Set(key.heap, heapToObject(st));
+
+    Handle<Value> argv[2];
+    // the type of event to emit
+    argv[0] = key.stats;
+    argv[1] = stats;
+    st.cb->Call(st.context, 2, argv);
+}
+
+static void AsyncMemwatchTimer(uv_timer_t * handle, int);
+
+// emit a stats event for the compactions since the last one, unless
+// nobody's listening or the interval and min delta say to hold off
+static void maybeEmitStats(Instance & instance)
+{
+    State & st = instance.watch;
+    memwatch::Emission & e = st.emission;
+
+    if (!e.compactions) return;
+    if (!st.statsListeners || st.cb.IsEmpty()) {
+        // nobody to tell, nothing to batch up
+        e.compactions = 0;
+        st.ring.dropped = 0;
+        return;
+    }
+
+    if (e.emitted) {
+        uint64_t base = st.stats.last_base;
+        uint64_t moved = base > e.lastBase ? base - e.lastBase : e.lastBase - base;
+        if (moved < e.minDelta) return;
+
+        uint64_t now = uv_now(instance.loop);
+        uint64_t since = now - e.lastTime;
+        if (since < e.interval) {
+            // the timer emits what we're holding once the interval is up
+            if (!e.timerArmed) {
+                e.timerArmed = true;
+                uv_timer_start(&st.timer, AsyncMemwatchTimer, e.interval - since, 0);
             }
+            return;
         }
     }
 
-    delete b;
+    emitStats(st);
+    e.emitted = true;
+    e.lastTime = uv_now(instance.loop);
+    e.lastBase = st.stats.last_base;
+    e.compactions = 0;
+    st.ring.dropped = 0;
 }
 
-static void noop_work_func(uv_work_t *) { }
+static void AsyncMemwatchTimer(uv_timer_t * handle, int) {
+    HandleScope scope;
+
+    Instance & instance = *(Instance *) handle->data;
+    instance.watch.emission.timerArmed = false;
+    maybeEmitStats(instance);
+}
+
+// drain every compaction recorded since the last wakeup, then emit (at
+// most) one stats event describing where that leaves us
+static void AsyncMemwatchAfter(uv_async_t * handle, int) {
+    HandleScope scope;
+
+    Instance & instance = *(Instance *) handle->data;
+    Ring & ring = instance.watch.ring;
+
+    // malloc's count is for now rather than each compaction's, but only
+    // out here on the loop is it safe to take, and once covers a burst
+    uint64_t malloced = instance.watch.watchNative ? nativemem::malloced() : 0;
+
+    bool compacted = false;
+    while (ring.tail != ring.head) {
+        GCRecord r = ring.records[ring.tail % memwatch::RING_SIZE];
+        r.native.malloced = malloced;
+        ring.tail++;
+
+        // do the math in C++, permanent
+        processCompaction(instance, r);
+        compacted = true;
+    }
+
+    if (compacted) maybeEmitStats(instance);
+}
 
 void memwatch::after_gc(GCType type, GCCallbackFlags flags)
 {
-    if (heapdiff::HeapDiff::InProgress()) return;
+    gcstats::after_gc(type);
 
-    HandleScope scope;
+    // the isolate that's collecting, which might not have loaded us
+    Instance * instance = Instance::current();
+    if (!instance || instance->diff.inProgress) return;
 
-    Baton * baton = new Baton;
-    v8::HeapStatistics hs;
+    State & st = instance->watch;
+
+    // record the type of GC event that occured.  that's all a scavenge
+    // costs us: no allocation, no heap statistics, no loop wakeup
+    if (type == kGCTypeMarkSweepCompact) st.stats.gc_full++;
+    else st.stats.gc_inc++;
 
+    GCRecord r;
+    r.type = type;
+    r.flags = flags;
+    if (!isCompaction(r)) return;
+
+    v8::HeapStatistics hs;
     v8::V8::GetHeapStatistics(&hs);
+    r.time = uv_hrtime() / 1e9;
+    r.heapUsage = hs.used_heap_size();
+    r.heapTotal = hs.total_heap_size();
+    r.heapExecutable = hs.total_heap_size_executable();
+    r.heapLimit = hs.heap_size_limit();
+    // a zero adjustment just reports the running total
+    r.external = V8::AdjustAmountOfExternalAllocatedMemory(0);
+    nativemem::read(r.native);
+
+    // no loop of ours on this thread, so nothing to hand the record to.
+    // heapStats() still sees the heap, nothing else happens
+    if (!instance->loop) {
+        recordHeap(*instance, r);
+        st.stats.gc_compact++;
+        return;
+    }
 
-    baton->heapUsage = hs.used_heap_size();
-    baton->type = type;
-    baton->flags = flags;
-    baton->req.data = (void *) baton;
+    if (st.ring.head - st.ring.tail >= memwatch::RING_SIZE) {
+        st.ring.dropped++;
+        return;
+    }
+    st.ring.records[st.ring.head % memwatch::RING_SIZE] = r;
+    st.ring.head++;
 
-    // schedule our work to run in a moment, once gc has fully completed.
-    // 
-    // here we pass a noop work function to work around a flaw in libuv, 
-    // uv_queue_work on unix works fine, but will will crash on
-    // windows.  see: https://github.com/joyent/libuv/pull/629  
-    uv_queue_work(uv_default_loop(), &(baton->req),
-		  noop_work_func, (uv_after_work_cb)AsyncMemwatchAfter);
+    // handle the record in a moment, once gc has fully completed.  sends
+    // made before the loop gets around to us are coalesced into one call
+    uv_async_send(&st.async);
+}
 
-    scope.Close(Undefined());
+void memwatch::start()
+{
+    Instance * instance = Instance::current();
+    initKeys(instance->watch.keys);
+    if (!instance->loop) return;
+
+    uv_async_t * async = &instance->watch.async;
+    uv_async_init(instance->loop, async, AsyncMemwatchAfter);
+    async->data = instance;
+
+    uv_timer_t * timer = &instance->watch.timer;
+    uv_timer_init(instance->loop, timer);
+    timer->data = instance;
+
+    // watching gc shouldn't keep the process alive
+#if NODE_VERSION_AT_LEAST(0,7,9)
+    uv_unref((uv_handle_t *) async);
+    uv_unref((uv_handle_t *) timer);
+#else
+    uv_unref(instance->loop);
+    uv_unref(instance->loop);
+#endif
 }
 
 Handle<Value> memwatch::upon_gc(const Arguments& args) {
     HandleScope scope;
+    Instance * instance = Instance::current();
+    if (!instance) return Instance::missing();
     if (args.Length() >= 1 && args[0]->IsFunction()) {
-        g_cb = Persistent<Function>::New(Handle<Function>::Cast(args[0]));
-        g_context = Persistent<Object>::New(Context::GetCalling()->Global());
+        State & st = instance->watch;
+        st.cb = Persistent<Function>::New(Handle<Function>::Cast(args[0]));
+        st.context = Persistent<Object>::New(Context::GetCalling()->Global());
     }
     return scope.Close(Undefined());
 }
@@ -251,3 +490,175 @@ Handle<Value> memwatch::trigger_gc(const Arguments& args) {
     while(!V8::IdleNotification()) {};
     return scope.Close(Undefined());
 }
+
+Handle<Value> memwatch::heap_stats(const Arguments&) {
+    HandleScope scope;
+    Instance * instance = Instance::current();
+    if (!instance) return Instance::missing();
+    return scope.Close(heapToObject(instance->watch));
+}
+
+Handle<Value> memwatch::process_stats(const Arguments&) {
+    HandleScope scope;
+
+    memwatch::Totals t;
+    memwatch::totals(t);
+
+    Local<Object> o = Object::New();
+    o->Set(String::New("isolates"), Integer::New(t.isolates));
+    o->Set(String::New("used"), Number::New((double) t.used));
+    o->Set(String::New("total"), Number::New((double) t.total));
+    o->Set(String::New("external"), Number::New((double) t.external));
+    return scope.Close(o);
+}
+
+static void readOption(Handle<Object> o, const char * name, unsigned int & out)
+{
+    Local<Value> v = o->Get(String::New(name));
+    if (v->IsNumber() && v->NumberValue() >= 0) out = v->Uint32Value();
+}
+
+static void readOption(Handle<Object> o, const char * name, double & out)
+{
+    Local<Value> v = o->Get(String::New(name));
+    if (v->IsNumber()) out = v->NumberValue();
+}
+
+// a probability or smoothing factor, where 0 and 1 make no sense
+static bool readFraction(Handle<Object> o, const char * name, double & out)
+{
+    double v = out;
+    readOption(o, name, v);
+    if (!(v > 0 && v < 1)) return false;
+    out = v;
+    return true;
+}
+
+// fills in options from o, throwing (and returning an empty handle) if
+// any of them is out of range
+static Handle<Value> readDetectorOptions(Handle<Object> o,
+                                         leakdetector::Options & options)
+{
+    readOption(o, "warmup", options.warmup);
+    readOption(o, "window", options.window);
+    readOption(o, "minSamples", options.minSamples);
+    readOption(o, "confirm", options.confirm);
+    readOption(o, "changeThreshold", options.changeThreshold);
+
+    const char * fractions[] = { "confidence", "alpha", "beta" };
+    double * values[] = { &options.confidence, &options.alpha, &options.beta };
+    for (size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++) {
+        if (!readFraction(o, fractions[i], *values[i])) {
+            std::string msg = std::string("configureLeakDetector: ") +
+                fractions[i] + " must be between 0 and 1";
+            return ThrowException(Exception::RangeError(String::New(msg.c_str())));
+        }
+    }
+    return Handle<Value>();
+}
+
+Handle<Value> memwatch::configure_leak_detector(const Arguments& args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsObject()) {
+        return ThrowException(Exception::TypeError(
+            String::New("configureLeakDetector takes an options object")));
+    }
+
+    Instance * instance = Instance::current();
+    if (!instance) return Instance::missing();
+
+    Local<Object> o = args[0]->ToObject();
+    State & st = instance->watch;
+    leakdetector::Engine & detector = st.detector;
+    leakdetector::Options options = detector.options();
+    Handle<Value> thrown = readDetectorOptions(o, options);
+    if (!thrown.IsEmpty()) return thrown;
+    detector.configure(options);
+    st.nativeDetector.configure(options);
+
+    Local<Value> native = o->Get(String::New("native"));
+    if (native->IsBoolean() && st.watchNative != native->BooleanValue()) {
+        st.watchNative = native->BooleanValue();
+        st.nativeDetector.reset();
+    }
+
+    return scope.Close(Undefined());
+}
+
+Handle<Value> memwatch::simulate_leak_detector(const Arguments& args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsArray()) {
+        return ThrowException(Exception::TypeError(
+            String::New("simulate_leak_detector takes an array of heap sizes")));
+    }
+
+    leakdetector::Options options;
+    if (args.Length() >= 2 && args[1]->IsObject()) {
+        Handle<Value> thrown = readDetectorOptions(args[1]->ToObject(), options);
+        if (!thrown.IsEmpty()) return thrown;
+    }
+
+    leakdetector::Engine detector;
+    detector.configure(options);
+
+    // a compaction a second, with a limit nothing will reach.  leaks are
+    // reported and forgotten, as after_gc's do
+    Local<Array> series = Local<Array>::Cast(args[0]);
+    Local<Array> leaks = Array::New();
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < series->Length(); i++) {
+        leakdetector::Observation o;
+        o.time = i;
+        o.used = series->Get(i)->NumberValue();
+        o.limit = 1e15;
+        leakdetector::Verdict v;
+        if (detector.observe(o, v)) {
+            leaks->Set(found++, Integer::NewFromUnsigned(i));
+            detector.reset();
+        }
+    }
+
+    return scope.Close(leaks);
+}
+
+Handle<Value> memwatch::configure_stats(const Arguments& args) {
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsObject()) {
+        return ThrowException(Exception::TypeError(
+            String::New("configureStats takes an options object")));
+    }
+
+    Instance * instance = Instance::current();
+    if (!instance) return Instance::missing();
+
+    Local<Object> o = args[0]->ToObject();
+    Emission & e = instance->watch.emission;
+    double interval = (double) e.interval, minDelta = (double) e.minDelta;
+    readOption(o, "interval", interval);
+    readOption(o, "minDelta", minDelta);
+    e.interval = interval > 0 ? (uint64_t) interval : 0;
+    e.minDelta = minDelta > 0 ? (uint64_t) minDelta : 0;
+
+    return scope.Close(Undefined());
+}
+
+Handle<Value> memwatch::set_listeners(const Arguments& args) {
+    HandleScope scope;
+
+    Instance * instance = Instance::current();
+    if (!instance) return Instance::missing();
+
+    State & st = instance->watch;
+    bool stats = args.Length() >= 1 && args[0]->BooleanValue();
+    bool leak = args.Length() >= 2 && args[1]->BooleanValue();
+    if ((stats || leak) && !instance->loop) {
+        return Instance::offLoop("stats and leak events");
+    }
+    st.statsListeners = stats;
+    st.leakListeners = leak;
+
+    return scope.Close(Undefined());
+}
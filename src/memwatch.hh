@@ -5,13 +5,180 @@
 #ifndef __MEMWATCH_HH
 #define __MEMWATCH_HH
 
+#include "heaphistory.hh"
+#include "leakdetector.hh"
+#include "nativemem.hh"
+
 #include <node.h>
 
 namespace memwatch
 {
+    // what we record about each full GC, in the gc callback where we can't
+    // call into javascript
+    struct GCRecord {
+        // seconds, from a monotonic clock
+        double time;
+        size_t heapUsage;
+        size_t heapTotal;
+        size_t heapExecutable;
+        size_t heapLimit;
+        // buffers and the like, as V8 has been told about them
+        int64_t external;
+        nativemem::Reading native;
+        v8::GCType type;
+        v8::GCCallbackFlags flags;
+    };
+
+    static const unsigned int RING_SIZE = 64;
+
+    // a preallocated single producer, single consumer ring of GC records.
+    // after_gc produces, the uv_async_t callback consumes; a burst of
+    // compactions between two turns of the loop costs one wakeup.
+    struct Ring
+    {
+        GCRecord records[RING_SIZE];
+        // free running counters, head - tail records are waiting
+        volatile unsigned int head;
+        volatile unsigned int tail;
+        // records lost because the ring was full, since the last stats
+        // event.  after_gc and the drain share the loop's thread, so a
+        // plain count will do
+        unsigned int dropped;
+    };
+
+    struct Stats
+    {
+        // counts of different types of gc events
+        unsigned int gc_full;
+        unsigned int gc_inc;
+        unsigned int gc_compact;
+
+        // heap sizes are 64 bit all the way through, big servers have big heaps
+
+        // last base heap size as measured *right* after GC
+        uint64_t last_base;
+
+        // the estimated "base memory" usage of the javascript heap
+        // over the RECENT_PERIOD number of GC runs
+        uint64_t base_recent;
+
+        // the estimated "base memory" usage of the javascript heap
+        // over the ANCIENT_PERIOD number of GC runs
+        uint64_t base_ancient;
+
+        // the most extreme values we've seen for base heap size
+        uint64_t base_max;
+        uint64_t base_min;
+    };
+
+    // event names and property names for what we emit, created once so
+    // that an event costs no garbage beyond its own objects
+    struct Keys
+    {
+        v8::Persistent<v8::String> stats;
+        v8::Persistent<v8::String> leak;
+
+        v8::Persistent<v8::String> num_full_gc;
+        v8::Persistent<v8::String> num_inc_gc;
+        v8::Persistent<v8::String> heap_compactions;
+        v8::Persistent<v8::String> usage_trend;
+        v8::Persistent<v8::String> estimated_base;
+        v8::Persistent<v8::String> current_base;
+        v8::Persistent<v8::String> min;
+        v8::Persistent<v8::String> max;
+        v8::Persistent<v8::String> compactions_since_last;
+        v8::Persistent<v8::String> min_since_last;
+        v8::Persistent<v8::String> max_since_last;
+        v8::Persistent<v8::String> dropped_since_last;
+        v8::Persistent<v8::String> pause;
+        v8::Persistent<v8::String> heap;
+        // stats objects start out with every key in place, one shape
+        v8::Persistent<v8::ObjectTemplate> statsTemplate;
+
+        v8::Persistent<v8::String> series[heaphistory::kSeriesCount];
+        v8::Persistent<v8::String> limit;
+        v8::Persistent<v8::String> fragmentation;
+        v8::Persistent<v8::String> trend;
+        v8::Persistent<v8::String> samples;
+    };
+
+    // when stats events go out: at most one every interval ms, and only
+    // once the base has moved minDelta bytes since the last one.  the
+    // compactions in between are folded into the next event.
+    struct Emission
+    {
+        Emission() : interval(0), minDelta(0), emitted(false), lastTime(0),
+                     lastBase(0), timerArmed(false), compactions(0), min(0),
+                     max(0) { }
+
+        uint64_t interval;
+        uint64_t minDelta;
+
+        bool emitted;
+        // loop time (ms) and base of the last event
+        uint64_t lastTime;
+        uint64_t lastBase;
+        // a timer will deliver what's held back by the interval
+        bool timerArmed;
+
+        // compactions since the last event, and the range of their bases
+        unsigned int compactions;
+        uint64_t min;
+        uint64_t max;
+    };
+
+    // what memwatch knows about one isolate's heap
+    struct State
+    {
+        State();
+
+        // the javascript side, which emits our events
+        v8::Persistent<v8::Object> context;
+        v8::Persistent<v8::Function> cb;
+        // whether anyone's listening, as include.js tells us.  nobody
+        // listening, nothing is built and javascript isn't called
+        bool statsListeners;
+        bool leakListeners;
+
+        Ring ring;
+        uv_async_t async;
+        Stats stats;
+
+        Emission emission;
+        uv_timer_t timer;
+        Keys keys;
+
+        // leak detection!  one engine for the javascript heap, one for
+        // memory outside of it
+        leakdetector::Engine detector;
+        leakdetector::Engine nativeDetector;
+        // false stops native readings beyond rss, and native leak reports
+        bool watchNative;
+
+        // the heap after each recent compaction
+        heaphistory::History history;
+    };
+
     v8::Handle<v8::Value> upon_gc(const v8::Arguments& args);
     v8::Handle<v8::Value> trigger_gc(const v8::Arguments& args);
     void after_gc(v8::GCType type, v8::GCCallbackFlags flags);
+    // set up what after_gc needs to hand records to the current isolate's
+    // event loop
+    void start();
+    // the heap after the last compaction and its trend
+    v8::Handle<v8::Value> heap_stats(const v8::Arguments& args);
+    // the heap summed over every isolate in the process
+    v8::Handle<v8::Value> process_stats(const v8::Arguments& args);
+    // memwatch.configureLeakDetector({ confidence: 0.99, window: 60, ... })
+    v8::Handle<v8::Value> configure_leak_detector(const v8::Arguments& args);
+    // memwatch._simulateLeakDetector(heapSizes, options) runs a fresh
+    // detector over one heap size per compaction, a second apart, and
+    // returns the indexes where it called a leak.  for tests
+    v8::Handle<v8::Value> simulate_leak_detector(const v8::Arguments& args);
+    // memwatch.configureStats({ interval: ms, minDelta: bytes })
+    v8::Handle<v8::Value> configure_stats(const v8::Arguments& args);
+    // include.js tells us whether stats and leak events have listeners
+    v8::Handle<v8::Value> set_listeners(const v8::Arguments& args);
 };
 
 #endif
@@ -0,0 +1,94 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "nativemem.hh"
+
+#include <uv.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#if defined(__linux__)
+
+// /proc/self/statm is opened once and re-read from the start each time,
+// which is a single pread into a buffer on the stack
+static struct
+{
+    uv_once_t once;
+    int fd;
+    uint64_t pageSize;
+} s_statm = { UV_ONCE_INIT, -1, 0 };
+
+static void openStatm()
+{
+    s_statm.fd = open("/proc/self/statm", O_RDONLY);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    s_statm.pageSize = pageSize > 0 ? (uint64_t) pageSize : 4096;
+}
+
+static uint64_t rss()
+{
+    uv_once(&s_statm.once, openStatm);
+    if (s_statm.fd < 0) return 0;
+
+    // "size resident shared text lib data dt", in pages
+    char buf[128];
+    ssize_t len = pread(s_statm.fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) return 0;
+    buf[len] = 0;
+
+    const char * p = buf;
+    while (*p && *p != ' ') p++;
+    while (*p == ' ') p++;
+    uint64_t pages = 0;
+    for (; *p >= '0' && *p <= '9'; p++) pages = pages * 10 + (*p - '0');
+    return pages * s_statm.pageSize;
+}
+
+#else
+
+static uint64_t rss()
+{
+    size_t size = 0;
+    uv_err_t err = uv_resident_set_memory(&size);
+    if (err.code != UV_OK) return 0;
+    return size;
+}
+
+#endif
+
+uint64_t nativemem::malloced()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    // in use from the arenas plus what's mmap()ed directly
+    struct mallinfo2 mi = mallinfo2();
+    return (uint64_t) mi.uordblks + (uint64_t) mi.hblkhd;
+#elif defined(__GLIBC__)
+    // older glibc only has int fields, which wrap past 4gb.  wrapped,
+    // they still go up when usage does, mostly
+    struct mallinfo mi = mallinfo();
+    return (uint64_t) (unsigned int) mi.uordblks + (uint64_t) (unsigned int) mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+void nativemem::read(Reading & r)
+{
+    r.rss = rss();
+    r.malloced = 0;
+}
+
+uint64_t nativemem::footprint(const Reading & r, uint64_t heapTotal, uint64_t external)
+{
+    if (r.malloced) return r.malloced;
+    if (r.rss > heapTotal) return r.rss - heapTotal;
+    return external;
+}
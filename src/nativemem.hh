@@ -0,0 +1,38 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __NATIVEMEM_HH
+#define __NATIVEMEM_HH
+
+#include <stdint.h>
+
+// memory the javascript heap doesn't see: buffers, typed arrays, and
+// whatever node and its addons malloc.  rss is read in the gc callback
+// after every compaction, so nothing here allocates and that costs a
+// syscall.  malloc's count walks its arenas under its lock, so that's
+// left for the event loop.
+namespace nativemem
+{
+    struct Reading
+    {
+        // resident set size of the whole process, 0 if we can't tell
+        uint64_t rss;
+        // bytes malloc has handed out and not had back, 0 if we can't tell
+        uint64_t malloced;
+    };
+
+    // rss, leaving malloced 0 to be filled in with malloced() later
+    void read(Reading & r);
+
+    // bytes malloc has handed out and not had back, 0 if we can't tell.
+    // not from a gc callback: it locks and walks every arena
+    uint64_t malloced();
+
+    // the one figure native leak detection watches: malloc's count where
+    // we have it, else what's resident beyond the javascript heap, else
+    // V8's external memory
+    uint64_t footprint(const Reading & r, uint64_t heapTotal, uint64_t external);
+};
+
+#endif
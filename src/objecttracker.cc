@@ -0,0 +1,81 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "objecttracker.hh"
+
+#include <v8.h>
+#include <v8-profiler.h>
+
+using namespace v8;
+using namespace std;
+
+// receives V8's per fragment updates.  an update carries the current
+// count and size of a fragment, and only fragments that changed get one
+class heapdiff::FragmentStream : public OutputStream
+{
+  public:
+    FragmentStream(vector<ObjectTracker::Fragment> & f) : fragments(f) { }
+
+    void EndOfStream() { }
+
+    WriteResult WriteAsciiChunk(char *, int) {
+        return kAbort;
+    }
+
+    WriteResult WriteHeapStatsChunk(HeapStatsUpdate * data, int count) {
+        for (int i = 0; i < count; i++) {
+            if (data[i].index >= fragments.size()) fragments.resize(data[i].index + 1);
+            fragments[data[i].index].count = data[i].count;
+            fragments[data[i].index].size = data[i].size;
+        }
+        return kContinue;
+    }
+
+  private:
+    vector<ObjectTracker::Fragment> & fragments;
+};
+
+heapdiff::Mark
+heapdiff::ObjectTracker::start()
+{
+    if (!users++) HeapProfiler::StartHeapObjectsTracking();
+    return push();
+}
+
+heapdiff::Mark
+heapdiff::ObjectTracker::push()
+{
+    // V8 opens a new fragment on every push, starting from 0
+    size_t fragment = fragments.size();
+    fragments.resize(fragment + 1);
+
+    FragmentStream stream(fragments);
+    fragments[fragment].lastId = HeapProfiler::PushHeapObjectsStats(&stream);
+
+    Mark m;
+    m.fragment = fragment;
+    m.lastId = fragments[fragment].lastId;
+    live(0, fragment, m.count, m.size);
+    return m;
+}
+
+void
+heapdiff::ObjectTracker::stop()
+{
+    if (!users || --users) return;
+    HeapProfiler::StopHeapObjectsTracking();
+    // V8 forgets its fragments, so do we
+    fragments.clear();
+}
+
+void
+heapdiff::ObjectTracker::live(size_t first, size_t last,
+                              int64_t & count, int64_t & size) const
+{
+    count = size = 0;
+    for (size_t i = first; i <= last && i < fragments.size(); i++) {
+        count += fragments[i].count;
+        size += fragments[i].size;
+    }
+}
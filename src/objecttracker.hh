@@ -0,0 +1,69 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __OBJECTTRACKER_HH
+#define __OBJECTTRACKER_HH
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace heapdiff
+{
+    // the heap at a point in time, as heap object tracking sees it
+    struct Mark
+    {
+        Mark() : fragment(0), lastId(0), count(0), size(0) { }
+
+        // the fragment holding every object allocated up to the mark
+        size_t fragment;
+        // the last object id handed out, anything newer came after
+        uint64_t lastId;
+        // live objects and their size, across all fragments
+        int64_t count;
+        int64_t size;
+    };
+
+    class FragmentStream;
+
+    // V8's heap object tracking, shared by every tracking diff in an
+    // isolate.  each push closes a fragment: the range of object ids
+    // handed out since the previous push.  V8 then tells us how many
+    // objects of each fragment are still alive, without a snapshot.
+    class ObjectTracker
+    {
+      public:
+        ObjectTracker() : users(0) { }
+
+        // start tracking if no one else is, then mark the heap.  pushing
+        // collects garbage, the caller must stand our gc hooks down
+        Mark start();
+        // mark the heap again, for a user that has already started
+        Mark push();
+        // a user is done, tracking stops with the last of them
+        void stop();
+
+        // objects still alive from fragments first through last
+        void live(size_t first, size_t last,
+                  int64_t & count, int64_t & size) const;
+
+      private:
+        struct Fragment
+        {
+            Fragment() : lastId(0), count(0), size(0) { }
+
+            uint64_t lastId;
+            uint32_t count;
+            uint32_t size;
+        };
+
+        friend class FragmentStream;
+
+        unsigned int users;
+        std::vector<Fragment> fragments;
+    };
+};
+
+#endif
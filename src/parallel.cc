@@ -0,0 +1,127 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "parallel.hh"
+
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h> // sysconf()
+#endif
+
+using namespace std;
+
+// set by force(), 0 when not
+static size_t s_forced = 0;
+
+unsigned int
+parallel::cpus()
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long n = info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n < 1 ? 1 : (unsigned int) n;
+}
+
+unsigned int
+parallel::partsFor(size_t items, unsigned int threads)
+{
+    // more threads than cpus only get in each other's way
+    unsigned int n = cpus();
+    if (!threads || (threads > n && !s_forced)) threads = n;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+    size_t worth = items / (s_forced ? s_forced : MIN_ITEMS);
+    if (worth < threads) threads = (unsigned int) worth;
+    return threads < 1 ? 1 : threads;
+}
+
+void
+parallel::force(size_t minItems)
+{
+    s_forced = minItems;
+}
+
+struct Part
+{
+    parallel::Job * job;
+    unsigned int part;
+};
+
+#if defined(_WIN32)
+typedef HANDLE Thread;
+
+static DWORD WINAPI runPart(LPVOID arg)
+{
+    Part * p = (Part *) arg;
+    p->job->run(p->part);
+    return 0;
+}
+
+static bool start(Thread & t, Part * p)
+{
+    t = CreateThread(NULL, 0, runPart, p, 0, NULL);
+    return t != NULL;
+}
+
+static void join(Thread & t)
+{
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+#else
+typedef pthread_t Thread;
+
+static void * runPart(void * arg)
+{
+    Part * p = (Part *) arg;
+    p->job->run(p->part);
+    return NULL;
+}
+
+static bool start(Thread & t, Part * p)
+{
+    return pthread_create(&t, NULL, runPart, p) == 0;
+}
+
+static void join(Thread & t)
+{
+    pthread_join(t, NULL);
+}
+#endif
+
+void
+parallel::run(Job & job, unsigned int parts)
+{
+    if (parts <= 1) {
+        job.run(0);
+        return;
+    }
+
+    vector<Part> p(parts);
+    vector<Thread> threads(parts);
+    vector<bool> started(parts, false);
+
+    for (unsigned int i = 1; i < parts; i++) {
+        p[i].job = &job;
+        p[i].part = i;
+        started[i] = start(threads[i], &p[i]);
+    }
+
+    job.run(0);
+    for (unsigned int i = 1; i < parts; i++) {
+        if (!started[i]) job.run(i);
+    }
+
+    for (unsigned int i = 1; i < parts; i++) {
+        if (started[i]) join(threads[i]);
+    }
+}
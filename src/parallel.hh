@@ -0,0 +1,55 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __PARALLEL_HH
+#define __PARALLEL_HH
+
+#include <stddef.h>
+
+// fork and join for the parts of a diff that walk every node.  no pool,
+// threads are started per call, so callers only split work big enough
+// to pay for a thread.  nothing here touches V8 or libuv, memwatch-diff
+// uses it too.
+namespace parallel
+{
+    // the most threads a piece of work is split across
+    static const unsigned int MAX_THREADS = 64;
+
+    // the fewest items worth handing a thread of their own
+    static const size_t MIN_ITEMS = 32768;
+
+    // cpus online
+    unsigned int cpus();
+
+    // how many parts to split this many items into, given at most threads
+    // of them (0 for one per cpu, and never more than that)
+    unsigned int partsFor(size_t items, unsigned int threads);
+
+    // for tests: split work into parts of as few as minItems, and as many
+    // parts as threads asks for whatever the cpu count, so that small
+    // heaps on small machines take the parallel paths.  0 goes back to
+    // MIN_ITEMS and one thread per cpu
+    void force(size_t minItems);
+
+    // where part p of n items split into parts begins
+    inline size_t begin(size_t n, unsigned int part, unsigned int parts)
+    {
+        return (size_t) ((unsigned long long) n * part / parts);
+    }
+
+    // work split into parts, run() may be called for each at once
+    class Job
+    {
+      public:
+        virtual ~Job() { }
+        virtual void run(unsigned int part) = 0;
+    };
+
+    // run every part of job, each on its own thread (part 0 on ours), and
+    // return once they're all done.  a part whose thread can't be started
+    // runs on ours too.
+    void run(Job & job, unsigned int parts);
+};
+
+#endif
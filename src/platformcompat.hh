@@ -6,15 +6,39 @@
 #if defined(_MSC_VER)
 #include <float.h> //isinf, isnan
 #include <stdlib.h> //min
+#include <process.h> //_getpid
 #define ISINF _finite
 #define ISNAN _isnan
 #define FMIN __min
 #define ROUND(x) floor(x + 0.5)
+#define GETPID _getpid
 #else
+#include <unistd.h> //getpid
 #define ISINF isinf
 #define ISNAN isnan
 #define FMIN fmin
 #define ROUND round
+#define GETPID getpid
+#endif
+
+// atomically turn a byte that's 0 into 1, true if it was us that did
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CLAIM(p) (_InterlockedCompareExchange8((char *) (p), 1, 0) == 0)
+#else
+#define CLAIM(p) __sync_bool_compare_and_swap((p), 0, 1)
+#endif
+
+// whether such a byte is already 1, read without ordering but safe to race
+// with CLAIM().  worth it to skip the locked instruction most of the time
+#if defined(_MSC_VER)
+#define CLAIMED(p) (*(volatile char *) (p) != 0)
+#elif defined(__ATOMIC_RELAXED)
+#define CLAIMED(p) (__atomic_load_n((p), __ATOMIC_RELAXED) != 0)
+#else
+// gcc before 4.7 has no __atomic builtins, and its aligned byte loads are
+// atomic anyway
+#define CLAIMED(p) (*(volatile unsigned char *) (p) != 0)
 #endif
 
 #endif
\ No newline at end of file
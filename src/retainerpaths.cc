@@ -0,0 +1,56 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "retainerpaths.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+static const uint32_t UNDEFINED = snapshotindex::IdIndex::NOT_FOUND;
+
+snapshotindex::ShortestPaths::ShortestPaths(const Graph & g,
+                                            const vector<uint32_t> & targets)
+    : parent(g.nodeCount(), UNDEFINED), via(g.nodeCount(), UNDEFINED),
+      root(g.root)
+{
+    if (g.root >= g.nodeCount()) return;
+
+    vector<bool> wanted(g.nodeCount(), false);
+    size_t remaining = 0;
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (targets[i] != g.root && !wanted[targets[i]]) {
+            wanted[targets[i]] = true;
+            remaining++;
+        }
+    }
+
+    vector<uint32_t> queue;
+    queue.push_back(g.root);
+    parent[g.root] = g.root;
+
+    for (size_t head = 0; head < queue.size() && remaining; head++) {
+        uint32_t n = queue[head];
+        for (uint32_t e = g.firstEdge[n]; e < g.firstEdge[n + 1]; e++) {
+            uint32_t to = g.edges[e];
+            if (parent[to] != UNDEFINED || g.ignored[to]) continue;
+            if (!g.edgeTypes.empty() && g.edgeTypes[e] == kWeak) continue;
+
+            parent[to] = n;
+            via[to] = e;
+            if (wanted[to] && !--remaining) break;
+            queue.push_back(to);
+        }
+    }
+}
+
+void
+snapshotindex::ShortestPaths::path(uint32_t pos, vector<uint32_t> & edges) const
+{
+    edges.clear();
+    if (!reached(pos)) return;
+
+    for (uint32_t n = pos; n != root; n = parent[n]) edges.push_back(via[n]);
+    reverse(edges.begin(), edges.end());
+}
@@ -0,0 +1,43 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __RETAINERPATHS_HH
+#define __RETAINERPATHS_HH
+
+#include "snapshotindex.hh"
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace snapshotindex
+{
+    // the shortest paths from the root of a snapshot to a handful of
+    // nodes.  one breadth first search from the root, which stops as soon
+    // as every target has been reached; a parent node and edge per node
+    // is all it holds.  weak edges don't retain and are skipped, as are
+    // nodes the graph marks as ignored.
+    class ShortestPaths
+    {
+      public:
+        ShortestPaths(const Graph & graph, const std::vector<uint32_t> & targets);
+
+        bool reached(uint32_t pos) const {
+            return parent[pos] != IdIndex::NOT_FOUND;
+        }
+
+        // the edges followed from the root to pos, root first.  empty if
+        // pos wasn't reached (or is the root)
+        void path(uint32_t pos, std::vector<uint32_t> & edges) const;
+
+      private:
+        // per graph position: the node we were reached from and the edge
+        // that got us here, NOT_FOUND for nodes never reached
+        std::vector<uint32_t> parent;
+        std::vector<uint32_t> via;
+        uint32_t root;
+    };
+};
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "snapshotcopy.hh"
+
+#include <vector>
+
+using namespace v8;
+using namespace std;
+
+uint32_t
+snapshotindex::internName(const Handle<String> & str, NameTable & names)
+{
+    // one pass for names that fit, which is nearly all of them
+    char buf[256];
+    int chars = 0;
+    int len = str->WriteUtf8(buf, sizeof(buf), &chars, String::NO_NULL_TERMINATION);
+    if (chars == str->Length()) return names.intern(buf, len);
+
+    len = str->Utf8Length();
+    vector<char> big(len + 1);
+    str->WriteUtf8(&big[0], len + 1);
+    return names.intern(&big[0], len);
+}
+
+// append the first prefix bytes of a string node's contents
+static void copyString(const Handle<String> & str, uint32_t pos, size_t prefix,
+                       snapshotindex::StringContents & s)
+{
+    char buf[1024];
+    if (prefix > sizeof(buf)) prefix = sizeof(buf);
+
+    // never splits a character, so may write less than prefix
+    int n = str->WriteUtf8(buf, (int) prefix, NULL, String::NO_NULL_TERMINATION);
+
+    s.pos.push_back(pos);
+    s.lengths.push_back(str->Utf8Length());
+    s.text.append(buf, n);
+    s.offsets.push_back(s.text.size());
+}
+
+void
+snapshotindex::copySnapshot(const HeapSnapshot * snapshot, NameTable & names,
+                            Graph & g, const CopyOptions & options)
+{
+    HandleScope scope;
+
+    bool edgeNames = options.edgeNames;
+    g.strings.clear();
+    g.labels = NameTable();
+
+    uint32_t count = snapshot->GetNodesCount();
+
+    g.ids.resize(count);
+    g.types.resize(count);
+    g.names.resize(count);
+    g.sizes.resize(count);
+    g.ignored.assign(count, false);
+    g.firstEdge.resize(count + 1);
+
+    IdIndex ids;
+    ids.reserve(count);
+
+    // always ignore HeapDiff related memory
+    uint32_t heapDiffName = names.intern("HeapDiff", 8);
+    uint32_t sessionName = names.intern("HeapDiffSession", 15);
+
+    uint32_t edgeCount = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        HandleScope scope;
+        const HeapGraphNode * n = snapshot->GetNode(i);
+
+        g.ids[i] = n->GetId();
+        g.sizes[i] = n->GetSelfSize();
+        g.names[i] = NameTable::NO_NAME;
+        g.firstEdge[i] = edgeCount;
+        edgeCount += n->GetChildrenCount();
+
+        switch (n->GetType()) {
+            case HeapGraphNode::kArray: g.types[i] = kArray; break;
+            case HeapGraphNode::kString: {
+                g.types[i] = kString;
+                if (options.stringPrefix && g.ids[i] > options.stringsSince) {
+                    copyString(n->GetName(), i, options.stringPrefix, g.strings);
+                }
+                break;
+            }
+            case HeapGraphNode::kCode: g.types[i] = kCode; break;
+            case HeapGraphNode::kClosure: g.types[i] = kClosure; break;
+            case HeapGraphNode::kRegExp: g.types[i] = kRegExp; break;
+            case HeapGraphNode::kHeapNumber: g.types[i] = kHeapNumber; break;
+            case HeapGraphNode::kNative: g.types[i] = kNative; break;
+            case HeapGraphNode::kObject: {
+                g.types[i] = kObject;
+                g.names[i] = internName(n->GetName(), names);
+                if (g.names[i] == heapDiffName || g.names[i] == sessionName) {
+                    g.ignored[i] = true;
+                }
+                break;
+            }
+            default: {
+                g.types[i] = kHidden;
+                if (edgeNames) g.names[i] = internName(n->GetName(), g.labels);
+                break;
+            }
+        }
+
+        ids.insert(g.ids[i], i);
+    }
+    g.firstEdge[count] = edgeCount;
+
+    // now that every node has a position, resolve edge targets
+    g.edges.resize(edgeCount);
+    g.edgeTypes.resize(edgeCount);
+    if (edgeNames) g.edgeNames.resize(edgeCount);
+    else g.edgeNames.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        HandleScope scope;
+        const HeapGraphNode * n = snapshot->GetNode(i);
+        uint32_t e = g.firstEdge[i];
+        for (int j = 0; j < n->GetChildrenCount(); j++, e++) {
+            const HeapGraphEdge * edge = n->GetChild(j);
+            uint32_t to = ids.find(edge->GetToNode()->GetId());
+            // a dangling edge, point it back at ourselves so it's a no-op
+            g.edges[e] = (to == IdIndex::NOT_FOUND) ? i : to;
+            g.edgeTypes[e] = (uint8_t) edge->GetType();
+
+            if (edgeNames) {
+                Handle<Value> name = edge->GetName();
+                if (edge->GetType() == HeapGraphEdge::kElement ||
+                    edge->GetType() == HeapGraphEdge::kHidden)
+                {
+                    g.edgeNames[e] = name->Uint32Value();
+                } else if (name->IsString()) {
+                    g.edgeNames[e] = internName(name->ToString(), g.labels);
+                } else {
+                    g.edgeNames[e] = NameTable::NO_NAME;
+                }
+            }
+        }
+    }
+
+    g.root = ids.find(snapshot->GetRoot()->GetId());
+    if (g.root == IdIndex::NOT_FOUND) g.root = 0;
+}
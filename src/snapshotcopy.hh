@@ -0,0 +1,44 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __SNAPSHOTCOPY_HH
+#define __SNAPSHOTCOPY_HH
+
+#include "snapshotindex.hh"
+
+#include <v8.h>
+#include <v8-profiler.h>
+
+namespace snapshotindex
+{
+    // intern a node name without an intermediate std::string, names that
+    // fit are converted on the stack.  the table dedups by hash, so a name
+    // keeps its id in every copy made into the same table
+    uint32_t internName(const v8::Handle<v8::String> & str, NameTable & names);
+
+    // what a copy holds beyond what aggregation needs
+    struct CopyOptions
+    {
+        CopyOptions() : edgeNames(false), stringPrefix(0), stringsSince(0) { }
+
+        // edge names (and the names of hidden nodes), for retainer paths.
+        // they go in the graph's labels, not the names given
+        bool edgeNames;
+        // up to this many bytes of each string node with an id past
+        // stringsSince, for grouping strings.  0 copies none
+        size_t stringPrefix;
+        uint64_t stringsSince;
+    };
+
+    // copy a snapshot into a plain graph.  must run on the main thread,
+    // after which the snapshot may be deleted.  names are interned for
+    // object nodes only, which is all that aggregation needs.  edge names
+    // cost a string per edge and string contents a copy per string, so
+    // they're only copied on request.
+    void copySnapshot(const v8::HeapSnapshot * snapshot, NameTable & names,
+                      Graph & graph,
+                      const CopyOptions & options = CopyOptions());
+};
+
+#endif
@@ -0,0 +1,521 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "snapshotfile.hh"
+
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h> // memcpy(), strerror()
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace snapshotindex;
+
+static const char MAGIC[8] = { 'M', 'W', 'S', 'N', 'A', 'P', 0, 1 };
+static const uint32_t VERSION = 1;
+
+static const char BASELINE_MAGIC[8] = { 'M', 'W', 'B', 'A', 'S', 'E', 0, 1 };
+
+// the high bit of a node's type byte marks nodes the graph ignores
+static const uint8_t IGNORED = 0x80;
+
+// node, edge and string indexes are 32 bits wide
+static const uint64_t MAX_COUNT = 0xffffffffu;
+
+struct BaselineHeader
+{
+    char magic[8];
+    uint32_t version;
+    int32_t nodes;
+    int64_t size;
+    uint64_t time;
+    uint64_t count;
+};
+
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t root;
+    uint64_t time;
+    uint64_t nodes;
+    uint64_t edges;
+    uint64_t strings;
+    uint64_t stringBytes;
+    uint64_t edgeBytes;
+};
+
+static inline uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~((uint64_t) 7);
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+// an output file that tracks its length so sections can be padded
+class Writer
+{
+  public:
+    Writer(FILE * f) : f(f), len(0), ok(true) { }
+
+    void put(const void * data, size_t n) {
+        if (ok && n && fwrite(data, 1, n, f) != n) ok = false;
+        len += n;
+    }
+
+    void pad() {
+        static const char zeros[8] = { 0 };
+        put(zeros, align8(len) - len);
+    }
+
+    FILE * f;
+    uint64_t len;
+    bool ok;
+};
+
+static void putVarint(vector<uint8_t> & out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((uint8_t) (v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t) v);
+}
+
+bool
+snapshotfile::write(const char * path, const Graph & g,
+                    const NameTable & names, time_t time, uint64_t & bytes,
+                    string & err)
+{
+    uint32_t n = g.nodeCount();
+
+    // edge targets are encoded relative to the previous edge of the same
+    // node (or to the node itself), references tend to be near each other
+    vector<uint8_t> edgeBytes;
+    edgeBytes.reserve(g.edges.size() * 2);
+    for (uint32_t i = 0; i < n; i++) {
+        int64_t prev = i;
+        for (uint32_t e = g.firstEdge[i]; e < g.firstEdge[i + 1]; e++) {
+            putVarint(edgeBytes, zigzag((int64_t) g.edges[e] - prev));
+            prev = g.edges[e];
+        }
+    }
+
+    vector<uint32_t> sizes(n), nameIds(n);
+    vector<uint8_t> types(n);
+    for (uint32_t i = 0; i < n; i++) {
+        sizes[i] = g.sizes[i];
+        // hidden nodes' names are in the graph's labels, not in names
+        nameIds[i] = g.types[i] == kObject ? g.names[i] : NameTable::NO_NAME;
+        types[i] = g.types[i] | (g.ignored[i] ? IGNORED : 0);
+    }
+
+    vector<uint32_t> stringOffsets(names.size() + 1, 0);
+    for (uint32_t i = 0; i < names.size(); i++) {
+        stringOffsets[i + 1] = stringOffsets[i] + names.name(i).size();
+    }
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.root = g.root;
+    h.time = time;
+    h.nodes = n;
+    h.edges = g.edges.size();
+    h.strings = names.size();
+    h.stringBytes = stringOffsets[names.size()];
+    h.edgeBytes = edgeBytes.size();
+
+    FILE * f = fopen(path, "wb");
+    if (!f) {
+        err = string("can't open ") + path + ": " + strerror(errno);
+        return false;
+    }
+
+    Writer w(f);
+    w.put(&h, sizeof(h)); w.pad();
+    if (n) {
+        w.put(&g.ids[0], n * sizeof(uint64_t)); w.pad();
+        w.put(&sizes[0], n * sizeof(uint32_t)); w.pad();
+        w.put(&nameIds[0], n * sizeof(uint32_t)); w.pad();
+        w.put(&types[0], n); w.pad();
+    }
+    w.put(&g.firstEdge[0], (n + 1) * sizeof(uint32_t)); w.pad();
+    if (h.edges) {
+        if (g.edgeTypes.empty()) {
+            vector<uint8_t> none(h.edges, kElement);
+            w.put(&none[0], h.edges);
+        } else {
+            w.put(&g.edgeTypes[0], h.edges);
+        }
+        w.pad();
+        w.put(&edgeBytes[0], edgeBytes.size()); w.pad();
+    }
+    w.put(&stringOffsets[0], stringOffsets.size() * sizeof(uint32_t)); w.pad();
+    for (uint32_t i = 0; i < names.size(); i++) {
+        w.put(names.name(i).data(), names.name(i).size());
+    }
+    w.pad();
+
+    if (fclose(f) != 0) w.ok = false;
+    if (!w.ok) {
+        err = string("can't write ") + path + ": " + strerror(errno);
+        return false;
+    }
+    bytes = w.len;
+    return true;
+}
+
+// a read only view of a whole file, mapped where we can
+class snapshotfile::MappedFile
+{
+  public:
+    MappedFile() : data(NULL), len(0), mapped(false) { }
+    ~MappedFile() {
+#if !defined(_WIN32)
+        if (mapped) {
+            munmap((void *) data, len);
+            return;
+        }
+#endif
+        delete [] data;
+    }
+
+    bool open(const char * path, string & err) {
+#if !defined(_WIN32)
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            err = string("can't open ") + path + ": " + strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void * p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = (const char *) p;
+                len = st.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+        if (mapped) return true;
+#endif
+        // no mmap, read the whole thing
+        FILE * f = fopen(path, "rb");
+        if (!f) {
+            err = string("can't open ") + path + ": " + strerror(errno);
+            return false;
+        }
+        fseek(f, 0, SEEK_END);
+        len = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        char * buf = new char[len ? len : 1];
+        bool ok = fread(buf, 1, len, f) == len;
+        fclose(f);
+        data = buf;
+        if (!ok) {
+            err = string("can't read ") + path;
+            return false;
+        }
+        return true;
+    }
+
+    const char * data;
+    size_t len;
+
+  private:
+    bool mapped;
+};
+
+// walks the sections of a mapped file, checking bounds as it goes
+class Reader
+{
+  public:
+    Reader(const snapshotfile::MappedFile & f) : f(f), off(0), ok(true) { }
+
+    const char * take(uint64_t n) {
+        if (!ok || n > f.len || off > f.len - n) {
+            ok = false;
+            return NULL;
+        }
+        const char * p = f.data + off;
+        off = align8(off + n);
+        return p;
+    }
+
+    // a count from the file that would overflow n * sizeof(T), or that
+    // the file is too short to hold, is refused before anything's sized
+    template <class T> void column(vector<T> & out, uint64_t n) {
+        if (!ok || n > f.len / sizeof(T)) {
+            ok = false;
+            return;
+        }
+        const char * p = take(n * sizeof(T));
+        if (!p) return;
+        out.resize(n);
+        if (n) memcpy(&out[0], p, n * sizeof(T));
+    }
+
+    const snapshotfile::MappedFile & f;
+    uint64_t off;
+    bool ok;
+};
+
+bool
+snapshotfile::read(const char * path, NameTable & names, Graph & g,
+                   time_t & time, string & err)
+{
+    MappedFile f;
+    if (!f.open(path, err)) return false;
+
+    Reader r(f);
+    Header h;
+    const char * hp = r.take(sizeof(h));
+    if (hp) memcpy(&h, hp, sizeof(h));
+    if (!hp || memcmp(h.magic, MAGIC, sizeof(MAGIC)) || h.version != VERSION) {
+        err = string(path) + " is not a memwatch snapshot";
+        return false;
+    }
+
+    // counts too big for our indexes, or a root that isn't a node, are lies
+    if (h.nodes >= MAX_COUNT || h.edges >= MAX_COUNT || h.strings >= MAX_COUNT ||
+        (h.nodes && h.root >= h.nodes))
+    {
+        err = string(path) + " is truncated or corrupt";
+        return false;
+    }
+
+    time = h.time;
+    g.root = h.root;
+
+    vector<uint32_t> sizes, nameIds, stringOffsets;
+    r.column(g.ids, h.nodes);
+    r.column(sizes, h.nodes);
+    r.column(nameIds, h.nodes);
+    r.column(g.types, h.nodes);
+    r.column(g.firstEdge, h.nodes + 1);
+    if (h.edges) r.column(g.edgeTypes, h.edges);
+    const char * edgeBytes = h.edges ? r.take(h.edgeBytes) : NULL;
+    r.column(stringOffsets, h.strings + 1);
+    const char * strings = r.take(h.stringBytes);
+
+    bool ok = r.ok && g.firstEdge[0] == 0 && g.firstEdge[h.nodes] == h.edges &&
+              stringOffsets[0] == 0 && stringOffsets[h.strings] == h.stringBytes;
+    // everything below indexes with these, so they're checked before use:
+    // each node's edges must lie within the edges, each string within the
+    // strings, and each type must be one we have a type key for
+    for (uint32_t i = 0; ok && i < h.nodes; i++) {
+        ok = g.firstEdge[i] <= g.firstEdge[i + 1] &&
+             (g.types[i] & ~IGNORED) <= kSynthetic;
+    }
+    for (uint32_t i = 0; ok && i < h.strings; i++) {
+        ok = stringOffsets[i] <= stringOffsets[i + 1];
+    }
+    if (!ok) {
+        err = string(path) + " is truncated or corrupt";
+        return false;
+    }
+
+    // names in the file map to names in the (possibly shared) table
+    vector<uint32_t> remap(h.strings);
+    for (uint32_t i = 0; i < h.strings; i++) {
+        remap[i] = names.intern(strings + stringOffsets[i],
+                                stringOffsets[i + 1] - stringOffsets[i]);
+    }
+
+    g.sizes.resize(h.nodes);
+    g.names.resize(h.nodes);
+    g.ignored.resize(h.nodes);
+    for (uint32_t i = 0; i < h.nodes; i++) {
+        g.sizes[i] = sizes[i];
+        g.names[i] = nameIds[i] < h.strings ? remap[nameIds[i]]
+                                            : NameTable::NO_NAME;
+        g.ignored[i] = (g.types[i] & IGNORED) != 0;
+        g.types[i] &= ~IGNORED;
+    }
+
+    // and finally decode the edge targets
+    g.edges.resize(h.edges);
+    const uint8_t * p = (const uint8_t *) edgeBytes;
+    const uint8_t * end = p + h.edgeBytes;
+    for (uint32_t i = 0; i < h.nodes; i++) {
+        int64_t prev = i;
+        for (uint32_t e = g.firstEdge[i]; e < g.firstEdge[i + 1]; e++) {
+            uint64_t v = 0;
+            unsigned int shift = 0;
+            while (p < end && (*p & 0x80) && shift < 63) {
+                v |= (uint64_t) (*p++ & 0x7f) << shift;
+                shift += 7;
+            }
+            if (p == end || (*p & 0x80)) {
+                err = string(path) + " is truncated or corrupt";
+                return false;
+            }
+            v |= (uint64_t) *p++ << shift;
+            prev += unzigzag(v);
+            if (prev < 0 || (uint64_t) prev >= h.nodes) {
+                err = string(path) + " is truncated or corrupt";
+                return false;
+            }
+            g.edges[e] = prev;
+        }
+    }
+
+    return true;
+}
+
+// create a file at a fresh path from a template ending in XXXXXX, which
+// is filled in.  the file is new (never a link, or someone else's) and
+// readable only by us
+static FILE * createUnique(string & path)
+{
+    vector<char> name(path.begin(), path.end());
+    name.push_back(0);
+#if defined(_WIN32)
+    for (int tries = 0; tries < 100; tries++) {
+        vector<char> attempt(name);
+        if (_mktemp_s(&attempt[0], attempt.size())) return NULL;
+        int fd = _open(&attempt[0], _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY,
+                       _S_IREAD | _S_IWRITE);
+        if (fd >= 0) {
+            path = &attempt[0];
+            FILE * f = _fdopen(fd, "wb");
+            if (!f) _close(fd);
+            return f;
+        }
+        if (errno != EEXIST) return NULL;
+    }
+    return NULL;
+#else
+    // mode 0600, O_EXCL
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) return NULL;
+    path = &name[0];
+    FILE * f = fdopen(fd, "wb");
+    if (!f) close(fd);
+    return f;
+#endif
+}
+
+bool
+snapshotfile::writeBaseline(string & path, const heapdiff::Baseline & b,
+                            string & err)
+{
+    BaselineHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BASELINE_MAGIC, sizeof(BASELINE_MAGIC));
+    h.version = VERSION;
+    h.nodes = b.summary.nodes;
+    h.size = b.summary.size;
+    h.time = b.summary.time;
+    h.count = b.ids.size();
+
+    string tmpl = path;
+    FILE * f = createUnique(path);
+    if (!f) {
+        err = string("can't create ") + tmpl + ": " + strerror(errno);
+        return false;
+    }
+
+    Writer w(f);
+    w.put(&h, sizeof(h)); w.pad();
+    if (h.count) {
+        w.put(&b.ids[0], h.count * sizeof(uint64_t)); w.pad();
+        w.put(&b.keys[0], h.count * sizeof(uint32_t)); w.pad();
+        w.put(&b.sizes[0], h.count * sizeof(int)); w.pad();
+    }
+
+    if (fclose(f) != 0) w.ok = false;
+    if (!w.ok) {
+        err = string("can't write ") + path + ": " + strerror(errno);
+        remove(path.c_str());
+        path = tmpl;
+        return false;
+    }
+    return true;
+}
+
+snapshotfile::BaselineFile::BaselineFile() : file(NULL)
+{
+}
+
+snapshotfile::BaselineFile::~BaselineFile()
+{
+    delete file;
+}
+
+bool
+snapshotfile::BaselineFile::open(const char * path, size_t keyCount, string & err)
+{
+    delete file;
+    file = new MappedFile;
+    v = heapdiff::BaselineView();
+    if (!file->open(path, err)) return false;
+
+    Reader r(*file);
+    BaselineHeader h;
+    const char * hp = r.take(sizeof(h));
+    if (hp) memcpy(&h, hp, sizeof(h));
+    if (!hp || memcmp(h.magic, BASELINE_MAGIC, sizeof(BASELINE_MAGIC)) ||
+        h.version != VERSION)
+    {
+        err = string(path) + " is not a memwatch baseline";
+        return false;
+    }
+
+    if (h.count > file->len) {
+        err = string(path) + " is truncated or corrupt";
+        return false;
+    }
+
+    // every column starts 8 byte aligned, point straight into the file
+    const char * ids = r.take(h.count * sizeof(uint64_t));
+    const char * keys = r.take(h.count * sizeof(uint32_t));
+    const char * sizes = r.take(h.count * sizeof(int));
+    if (!r.ok) {
+        err = string(path) + " is truncated or corrupt";
+        return false;
+    }
+
+    // merges index tallies by these keys and step through ids in order, a
+    // file that's been tampered with mustn't take them out of bounds
+    const uint64_t * idp = (const uint64_t *) ids;
+    const uint32_t * keyp = (const uint32_t *) keys;
+    for (uint64_t i = 0; i < h.count; i++) {
+        if (keyp[i] >= keyCount || (i && idp[i] <= idp[i - 1])) {
+            err = string(path) + " is corrupt";
+            return false;
+        }
+    }
+
+    v.summary.nodes = h.nodes;
+    v.summary.size = h.size;
+    v.summary.time = h.time;
+    v.count = h.count;
+    v.ids = (const uint64_t *) ids;
+    v.keys = (const uint32_t *) keys;
+    v.sizes = (const int *) sizes;
+    return true;
+}
@@ -0,0 +1,67 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __SNAPSHOTFILE_HH
+#define __SNAPSHOTFILE_HH
+
+#include "changeset.hh"
+#include "snapshotindex.hh"
+
+#include <string>
+
+#include <time.h>
+
+// a compact binary snapshot format, for capturing heaps on one box and
+// diffing them on another.  after a fixed header come columnar node
+// arrays (id, self size, name index, type), edge offsets and types, edge
+// targets delta encoded as varints, and a deduplicated string table.
+// every fixed width section is 8 byte aligned so a mapped file can be
+// copied out column by column, no parsing required.
+namespace snapshotfile
+{
+    // write a graph and the names it refers to, setting bytes to the size
+    // of the file.  returns false and describes the problem in err on
+    // failure
+    bool write(const char * path, const snapshotindex::Graph & graph,
+               const snapshotindex::NameTable & names, time_t time,
+               uint64_t & bytes, std::string & err);
+
+    // read a file produced by write().  names are interned into the given
+    // table, so any number of files may be read into one table and their
+    // graphs compared.
+    bool read(const char * path, snapshotindex::NameTable & names,
+              snapshotindex::Graph & graph, time_t & time,
+              std::string & err);
+
+    // a HeapDiff's earlier heap, spilled to disk: a baseline's columns
+    // written out as they are in memory.  type keys refer to a name
+    // table the caller keeps.  path ends in XXXXXX, which is replaced to
+    // make a new file only we can read; an existing file or link is never
+    // opened.  on failure nothing is left behind
+    bool writeBaseline(std::string & path, const heapdiff::Baseline & baseline,
+                       std::string & err);
+
+    class MappedFile;
+
+    // a baseline file mapped back in, compared against without copying
+    class BaselineFile
+    {
+      public:
+        BaselineFile();
+        ~BaselineFile();
+
+        // every type key must be below keyCount, and ids must ascend
+        bool open(const char * path, size_t keyCount, std::string & err);
+        const heapdiff::BaselineView & view() const { return v; }
+
+      private:
+        BaselineFile(const BaselineFile &);
+        BaselineFile & operator=(const BaselineFile &);
+
+        MappedFile * file;
+        heapdiff::BaselineView v;
+    };
+};
+
+#endif
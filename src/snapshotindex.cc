@@ -0,0 +1,507 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "snapshotindex.hh"
+#include "parallel.hh"
+#include "platformcompat.hh"
+
+#include <algorithm>
+
+#include <string.h> // memset(), memcmp(), memcpy(), strlen()
+
+using namespace std;
+
+const uint32_t snapshotindex::IdIndex::NOT_FOUND;
+const uint32_t snapshotindex::NameTable::NO_NAME;
+
+static inline uint64_t hashId(uint64_t id)
+{
+    // node ids are handed out sequentially (and V8 uses only odd ones), so
+    // scramble them a bit before masking
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return id;
+}
+
+snapshotindex::IdIndex::IdIndex() : mask(0)
+{
+}
+
+void
+snapshotindex::IdIndex::reserve(size_t n)
+{
+    // keep the load factor at or below one half
+    size_t cap = 16;
+    while (cap < n * 2) cap <<= 1;
+
+    // id zero is never handed out by the profiler, use it to mark empty slots
+    keys.assign(cap, 0);
+    values.assign(cap, NOT_FOUND);
+    mask = cap - 1;
+}
+
+void
+snapshotindex::IdIndex::insert(uint64_t id, uint32_t pos)
+{
+    size_t i = hashId(id) & mask;
+    while (keys[i] != 0 && keys[i] != id) i = (i + 1) & mask;
+    keys[i] = id;
+    values[i] = pos;
+}
+
+uint32_t
+snapshotindex::IdIndex::find(uint64_t id) const
+{
+    if (keys.empty()) return NOT_FOUND;
+
+    size_t i = hashId(id) & mask;
+    while (keys[i] != 0) {
+        if (keys[i] == id) return values[i];
+        i = (i + 1) & mask;
+    }
+    return NOT_FOUND;
+}
+
+// FNV-1a
+static inline uint32_t hashName(const char * data, size_t len)
+{
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static inline uint64_t load64(const char * p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t mixLane(uint64_t h, uint64_t v)
+{
+    h ^= v * 0x9e3779b97f4a7c15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xc2b2ae3d27d4eb4fULL;
+}
+
+uint32_t
+snapshotindex::hashBytes(const char * data, size_t len)
+{
+    // four lanes with no dependency between them, so the multiplies of a
+    // block overlap (and a vectorizing compiler may do them at once)
+    uint64_t h[4] = { len, 0x243f6a8885a308d3ULL,
+                      0x13198a2e03707344ULL, 0xa4093822299f31d0ULL };
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        for (int l = 0; l < 4; l++) h[l] = mixLane(h[l], load64(data + i + 8 * l));
+    }
+
+    // the tail, zero padded
+    char tail[32];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + i, len - i);
+    if (len - i) {
+        for (int l = 0; l < 4; l++) h[l] = mixLane(h[l], load64(tail + 8 * l));
+    }
+
+    uint64_t r = h[0] ^ ((h[1] << 17) | (h[1] >> 47)) ^
+                 ((h[2] << 29) | (h[2] >> 35)) ^ ((h[3] << 43) | (h[3] >> 21));
+    r ^= r >> 33;
+    r *= 0xff51afd7ed558ccdULL;
+    r ^= r >> 33;
+    return (uint32_t) r;
+}
+
+bool
+snapshotindex::StringContents::find(uint32_t p, size_t & index) const
+{
+    vector<uint32_t>::const_iterator it = lower_bound(pos.begin(), pos.end(), p);
+    if (it == pos.end() || *it != p) return false;
+    index = it - pos.begin();
+    return true;
+}
+
+// what each node type is reported under, interned in this order first
+static const char * s_typeNames[] = {
+    NULL,       // kHidden
+    "Array",
+    "String",
+    NULL,       // kObject, named by constructor
+    "Code",
+    "Closure",
+    "RegExp",
+    "Number",
+    "Native",
+    NULL        // kSynthetic
+};
+
+// and so the ids they get
+static const uint32_t s_typeNameIds[] = {
+    snapshotindex::NameTable::NO_NAME, 0, 1, snapshotindex::NameTable::NO_NAME,
+    2, 3, 4, 5, 6, snapshotindex::NameTable::NO_NAME
+};
+
+snapshotindex::NameTable::NameTable() : slots(64, NO_NAME), mask(63)
+{
+    for (uint32_t t = 0; t <= kSynthetic; t++) {
+        if (s_typeNames[t]) intern(s_typeNames[t], strlen(s_typeNames[t]));
+    }
+}
+
+uint32_t
+snapshotindex::NameTable::typeName(uint32_t type)
+{
+    return type <= kSynthetic ? s_typeNameIds[type] : NO_NAME;
+}
+
+uint32_t
+snapshotindex::NameTable::intern(const char * data, size_t len)
+{
+    uint32_t h = hashName(data, len);
+    size_t i = h & mask;
+
+    while (slots[i] != NO_NAME) {
+        uint32_t id = slots[i];
+        if (hashes[id] == h && names[id].size() == len &&
+            !memcmp(names[id].data(), data, len))
+        {
+            return id;
+        }
+        i = (i + 1) & mask;
+    }
+
+    uint32_t id = names.size();
+    names.push_back(string(data, len));
+    hashes.push_back(h);
+    slots[i] = id;
+
+    // keep the load factor at or below one half
+    if (names.size() * 2 > slots.size()) grow();
+
+    return id;
+}
+
+void
+snapshotindex::NameTable::grow()
+{
+    slots.assign(slots.size() * 2, NO_NAME);
+    mask = slots.size() - 1;
+
+    for (uint32_t id = 0; id < names.size(); id++) {
+        size_t i = hashes[id] & mask;
+        while (slots[i] != NO_NAME) i = (i + 1) & mask;
+        slots[i] = id;
+    }
+}
+
+// one byte wide pass of a radix sort, split into contiguous slices.  each
+// slice counts its digits, then scatters to where the slices before it
+// (for the same digit) leave off, so the pass stays stable
+class RadixPass : public parallel::Job
+{
+  public:
+    RadixPass(const vector<snapshotindex::Entry> & from,
+              vector<snapshotindex::Entry> & to, unsigned int parts)
+        : from(from), to(to), parts(parts), shift(0), scatter(false),
+          counts(parts * 256) { }
+
+    void sort(unsigned int s) {
+        shift = s;
+        scatter = false;
+        counts.assign(counts.size(), 0);
+        parallel::run(*this, parts);
+
+        // turn per slice counts into per slice offsets
+        size_t at = 0;
+        for (unsigned int d = 0; d < 256; d++) {
+            for (unsigned int p = 0; p < parts; p++) {
+                size_t n = counts[p * 256 + d];
+                counts[p * 256 + d] = at;
+                at += n;
+            }
+        }
+
+        scatter = true;
+        parallel::run(*this, parts);
+    }
+
+    void run(unsigned int part) {
+        size_t b = parallel::begin(from.size(), part, parts);
+        size_t e = parallel::begin(from.size(), part + 1, parts);
+        size_t * c = &counts[part * 256];
+
+        if (!scatter) {
+            for (size_t i = b; i < e; i++) c[(from[i].id >> shift) & 0xff]++;
+        } else {
+            for (size_t i = b; i < e; i++) to[c[(from[i].id >> shift) & 0xff]++] = from[i];
+        }
+    }
+
+  private:
+    const vector<snapshotindex::Entry> & from;
+    vector<snapshotindex::Entry> & to;
+    unsigned int parts;
+    unsigned int shift;
+    bool scatter;
+    vector<size_t> counts;
+};
+
+// LSD radix sort on node id, only as many byte wide passes as the largest
+// id requires.  linear in the number of entries, unlike std::sort.
+static void sortById(vector<snapshotindex::Entry> & v, unsigned int threads)
+{
+    uint64_t maxId = 0;
+    for (size_t i = 0; i < v.size(); i++) {
+        if (v[i].id > maxId) maxId = v[i].id;
+    }
+
+    vector<snapshotindex::Entry> tmp(v.size());
+    unsigned int parts = parallel::partsFor(v.size(), threads);
+    RadixPass forward(v, tmp, parts);
+    RadixPass back(tmp, v, parts);
+
+    bool inTmp = false;
+    for (unsigned int shift = 0; shift < 64 && (maxId >> shift); shift += 8) {
+        if (inTmp) back.sort(shift);
+        else forward.sort(shift);
+        inTmp = !inTmp;
+    }
+    if (inTmp) v.swap(tmp);
+}
+
+// * matches any run of characters, ? any one
+static bool globMatch(const char * p, const char * s)
+{
+    const char * star = NULL;
+    const char * resume = NULL;
+
+    while (*s) {
+        if (*p == '*') {
+            star = p++;
+            resume = s;
+        } else if (*p == '?' || *p == *s) {
+            p++;
+            s++;
+        } else if (star) {
+            // let the last star swallow one more character
+            p = star + 1;
+            s = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*p == '*') p++;
+    return !*p;
+}
+
+void
+snapshotindex::Filter::prepare(const NameTable & table)
+{
+    if (names.empty()) return;
+
+    for (size_t id = matched.size(); id < table.size(); id++) {
+        bool m = false;
+        for (size_t i = 0; i < names.size() && !m; i++) {
+            m = globMatch(names[i].c_str(), table.name(id).c_str());
+        }
+        matched.push_back(m);
+    }
+}
+
+bool
+snapshotindex::Filter::accepts(const Graph & g, uint32_t pos) const
+{
+    if (types && !(types & (1 << g.types[pos]))) return false;
+    if (g.sizes[pos] < minSize) return false;
+    if (!names.empty()) {
+        uint32_t name = g.names[pos];
+        if (g.types[pos] != kObject || name >= matched.size() || !matched[name]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+snapshotindex::SnapshotIndex::SnapshotIndex(const Graph & graph,
+                                            const Filter * f,
+                                            unsigned int threads)
+    : g(graph), filter(f && !f->empty() ? f : NULL), threads(threads),
+      totalSize(0)
+{
+    traverse();
+    sortById(sorted, threads);
+}
+
+// one level of a breadth first walk, split into slices of the frontier.
+// a child belongs to whichever slice claims it first, and each slice
+// keeps its own entries and next frontier, so nothing else is shared.
+class Level : public parallel::Job
+{
+  public:
+    Level(const snapshotindex::Graph & g, const snapshotindex::Filter * filter,
+          vector<uint8_t> & seen, unsigned int threads)
+        : g(g), filter(filter), seen(seen), frontier(NULL), parts(1),
+          entries(threads), next(threads), sizes(threads) { }
+
+    void walk(const vector<uint32_t> & f, unsigned int p) {
+        frontier = &f;
+        parts = p;
+        for (unsigned int i = 0; i < parts; i++) {
+            entries[i].clear();
+            next[i].clear();
+            sizes[i] = 0;
+        }
+        parallel::run(*this, parts);
+    }
+
+    void run(unsigned int part) {
+        const vector<uint32_t> & f = *frontier;
+        size_t b = parallel::begin(f.size(), part, parts);
+        size_t e = parallel::begin(f.size(), part + 1, parts);
+        bool shared = parts > 1;
+
+        for (size_t k = b; k < e; k++) {
+            uint32_t pos = f[k];
+
+            if (!filter || filter->accepts(g, pos)) {
+                sizes[part] += g.sizes[pos];
+
+                snapshotindex::Entry entry;
+                entry.id = g.ids[pos];
+                entry.pos = pos;
+                entries[part].push_back(entry);
+            }
+
+            for (uint32_t i = g.firstEdge[pos]; i < g.firstEdge[pos + 1]; i++) {
+                uint32_t child = g.edges[i];
+                if (g.ignored[child]) continue;
+                if (shared) {
+                    // other threads claim nodes as we look
+                    if (CLAIMED(&seen[child]) || !CLAIM(&seen[child])) continue;
+                } else {
+                    if (seen[child]) continue;
+                    seen[child] = 1;
+                }
+
+                next[part].push_back(child);
+            }
+        }
+    }
+
+    const snapshotindex::Graph & g;
+    const snapshotindex::Filter * filter;
+    vector<uint8_t> & seen;
+    const vector<uint32_t> * frontier;
+    unsigned int parts;
+
+    vector<vector<snapshotindex::Entry> > entries;
+    vector<vector<uint32_t> > next;
+    vector<int64_t> sizes;
+};
+
+void
+snapshotindex::SnapshotIndex::traverse()
+{
+    uint32_t root = g.root;
+    if (filter && filter->rootId) {
+        // a subtree of interest, nothing outside of it is visited
+        root = IdIndex::NOT_FOUND;
+        for (uint32_t i = 0; i < g.nodeCount(); i++) {
+            if (g.ids[i] == filter->rootId) {
+                root = i;
+                break;
+            }
+        }
+    }
+    if (root >= g.nodeCount()) return;
+
+    if (!filter) sorted.reserve(g.nodeCount());
+
+    unsigned int parts = parallel::partsFor(g.nodeCount(), threads);
+    if (parts > 1) byLevel(root, parts);
+    else depthFirst(root);
+}
+
+void
+snapshotindex::SnapshotIndex::depthFirst(uint32_t root)
+{
+    // an explicit stack rather than recursion, object chains in real
+    // heaps get deep enough to blow the native stack
+    vector<bool> seen(g.nodeCount(), false);
+    vector<uint32_t> stack;
+
+    stack.push_back(root);
+    seen[root] = true;
+
+    while (!stack.empty()) {
+        uint32_t pos = stack.back();
+        stack.pop_back();
+
+        if (!filter || filter->accepts(g, pos)) {
+            // update memory usage as we go
+            totalSize += g.sizes[pos];
+
+            Entry e;
+            e.id = g.ids[pos];
+            e.pos = pos;
+            sorted.push_back(e);
+        }
+
+        for (uint32_t i = g.firstEdge[pos]; i < g.firstEdge[pos + 1]; i++) {
+            uint32_t child = g.edges[i];
+            // ignored nodes are never marked, their subtrees are only
+            // reached through other paths
+            if (seen[child] || g.ignored[child]) continue;
+
+            seen[child] = true;
+            stack.push_back(child);
+        }
+    }
+}
+
+void
+snapshotindex::SnapshotIndex::byLevel(uint32_t root, unsigned int most)
+{
+    // levels too narrow to be worth splitting are walked on this thread
+    // alone
+    vector<uint8_t> seen(g.nodeCount(), 0);
+    vector<uint32_t> frontier(1, root);
+    seen[root] = 1;
+
+    Level level(g, filter, seen, most);
+
+    while (!frontier.empty()) {
+        unsigned int parts = min(most, parallel::partsFor(frontier.size(), threads));
+        level.walk(frontier, parts);
+
+        frontier.clear();
+        for (unsigned int p = 0; p < parts; p++) {
+            totalSize += level.sizes[p];
+            sorted.insert(sorted.end(), level.entries[p].begin(), level.entries[p].end());
+            if (parts == 1) frontier.swap(level.next[p]);
+            else frontier.insert(frontier.end(), level.next[p].begin(), level.next[p].end());
+        }
+    }
+}
+
+void
+snapshotindex::diff(const SnapshotIndex & a, const SnapshotIndex & b,
+                    vector<uint32_t> & onlyA, vector<uint32_t> & onlyB)
+{
+    const vector<Entry> & ea = a.entries();
+    const vector<Entry> & eb = b.entries();
+    size_t i = 0, j = 0;
+
+    while (i < ea.size() && j < eb.size()) {
+        if (ea[i].id < eb[j].id) onlyA.push_back(ea[i++].pos);
+        else if (eb[j].id < ea[i].id) onlyB.push_back(eb[j++].pos);
+        else { i++; j++; }
+    }
+    while (i < ea.size()) onlyA.push_back(ea[i++].pos);
+    while (j < eb.size()) onlyB.push_back(eb[j++].pos);
+}
@@ -0,0 +1,256 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __SNAPSHOTINDEX_HH
+#define __SNAPSHOTINDEX_HH
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace snapshotindex
+{
+    // node types, numbered as v8::HeapGraphNode::Type
+    enum NodeType {
+        kHidden = 0,
+        kArray = 1,
+        kString = 2,
+        kObject = 3,
+        kCode = 4,
+        kClosure = 5,
+        kRegExp = 6,
+        kHeapNumber = 7,
+        kNative = 8,
+        kSynthetic = 9
+    };
+
+    // edge types, numbered as v8::HeapGraphEdge::Type
+    enum EdgeType {
+        kContextVariable = 0,
+        kElement = 1,
+        kProperty = 2,
+        kInternal = 3,
+        kHiddenEdge = 4,
+        kShortcut = 5,
+        kWeak = 6
+    };
+
+    // an open addressing hash table mapping snapshot node ids to the
+    // position of the node in the snapshot (as in HeapSnapshot::GetNode()).
+    // a replacement for HeapSnapshot::GetNodeById() which we can size
+    // up front and probe without allocation.
+    class IdIndex
+    {
+      public:
+        static const uint32_t NOT_FOUND = 0xffffffff;
+
+        IdIndex();
+
+        // prepare the table to hold n ids
+        void reserve(size_t n);
+        void insert(uint64_t id, uint32_t pos);
+        // returns NOT_FOUND if the id is not in the table
+        uint32_t find(uint64_t id) const;
+        bool empty() const { return keys.empty(); }
+
+        void swap(IdIndex & other) {
+            keys.swap(other.keys);
+            values.swap(other.values);
+            std::swap(mask, other.mask);
+        }
+
+      private:
+        std::vector<uint64_t> keys;
+        std::vector<uint32_t> values;
+        size_t mask;
+    };
+
+    // interned node names, shared by the graphs being compared.  an open
+    // addressing table keyed by a hash of the name's bytes, so interning a
+    // name we've already seen allocates nothing.
+    //
+    // every table starts out with the names node types are reported under
+    // ("Array", "String", ...), so a type and the objects whose constructor
+    // has the same name (arrays and Array objects, say) share a name id.
+    class NameTable
+    {
+      public:
+        static const uint32_t NO_NAME = 0xffffffff;
+
+        NameTable();
+
+        // the id of the name a node type is reported under, the same in
+        // every table.  NO_NAME for objects (named by their constructor)
+        // and for the hidden and synthetic nodes we don't report
+        static uint32_t typeName(uint32_t type);
+
+        uint32_t intern(const char * data, size_t len);
+        uint32_t intern(const std::string & name) {
+            return intern(name.data(), name.size());
+        }
+        const std::string & name(uint32_t id) const { return names[id]; }
+        size_t size() const { return names.size(); }
+
+      private:
+        void grow();
+
+        std::vector<std::string> names;
+        std::vector<uint32_t> hashes;
+        // name ids, NO_NAME marks an empty slot
+        std::vector<uint32_t> slots;
+        size_t mask;
+    };
+
+    // a 32 bit hash of a run of bytes, 32 of them at a time in four
+    // independent lanes, which keeps long strings cheap to hash
+    uint32_t hashBytes(const char * data, size_t len);
+
+    // the contents of some of a graph's string nodes, each cut short at a
+    // prefix.  only strings newer than the earlier heap are copied, so
+    // this is sized to what's new rather than to the heap.
+    struct StringContents
+    {
+        StringContents() : offsets(1, 0) { }
+
+        void clear() {
+            pos.clear();
+            lengths.clear();
+            offsets.assign(1, 0);
+            text.clear();
+        }
+
+        // the index of the copied string at pos, false if it wasn't copied
+        bool find(uint32_t pos, size_t & index) const;
+
+        size_t size() const { return pos.size(); }
+        const char * data(size_t i) const { return text.data() + offsets[i]; }
+        size_t copied(size_t i) const { return offsets[i + 1] - offsets[i]; }
+        bool truncated(size_t i) const { return copied(i) < lengths[i]; }
+
+        // positions of the copied strings, ascending
+        std::vector<uint32_t> pos;
+        // the full length of each, in utf8 bytes
+        std::vector<uint32_t> lengths;
+        // the prefix of string i is text[offsets[i]] .. text[offsets[i+1]]
+        std::vector<uint32_t> offsets;
+        std::string text;
+    };
+
+    // a plain copy of the parts of a v8::HeapSnapshot we need, which can
+    // be walked without V8 (and so off of the main thread).  nodes are
+    // addressed by position, edges are held in compressed sparse row form:
+    // the children of node n are edges[firstEdge[n]] .. edges[firstEdge[n+1]]
+    struct Graph
+    {
+        Graph() : root(0) { }
+
+        size_t nodeCount() const { return ids.size(); }
+
+        std::vector<uint64_t> ids;
+        std::vector<uint8_t> types;
+        // for objects an index into the NameTable the graph was copied
+        // with, for hidden nodes into labels.  NO_NAME for nodes whose name
+        // we skip
+        std::vector<uint32_t> names;
+        std::vector<int> sizes;
+        // nodes excluded from traversal (HeapDiff related memory)
+        std::vector<bool> ignored;
+        std::vector<uint32_t> firstEdge;
+        std::vector<uint32_t> edges;
+        std::vector<uint8_t> edgeTypes;
+        // only copied when retainer paths are wanted.  the index of
+        // element and hidden edges, the labels id of the rest
+        std::vector<uint32_t> edgeNames;
+        // the names of edges and hidden nodes, when retainer paths are
+        // wanted.  they're a graph's own, so a name table shared between
+        // graphs only ever holds what types are keyed by
+        NameTable labels;
+        // only copied when strings are grouped
+        StringContents strings;
+        uint32_t root;
+    };
+
+    // narrows what an index holds, so a diff costs in proportion to the
+    // part of the heap we care about.  a subtree root prunes the walk
+    // itself; nodes of other types, names or sizes are walked through (to
+    // reach what's beyond them) but never indexed, so they're never
+    // sorted, merged or reported.
+    class Filter
+    {
+      public:
+        Filter() : types(0), minSize(0), rootId(0) { }
+
+        bool empty() const {
+            return !types && !minSize && names.empty() && !rootId;
+        }
+
+        // match the patterns against every name in the table, before
+        // indexing a graph whose names it holds
+        void prepare(const NameTable & table);
+
+        bool accepts(const Graph & g, uint32_t pos) const;
+
+        // a bit per NodeType, 0 for every type
+        uint32_t types;
+        int minSize;
+        // patterns (* and ? wildcards) for the names of object nodes.
+        // when given, only object nodes with matching names are indexed
+        std::vector<std::string> names;
+        // the id of the node to walk from instead of the root, 0 for none
+        uint64_t rootId;
+
+      private:
+        // per name id, whether a pattern matched
+        std::vector<bool> matched;
+    };
+
+    struct Entry
+    {
+        uint64_t id;
+        uint32_t pos;
+    };
+
+    // the set of nodes reachable from the root of a snapshot, held as a
+    // contiguous array sorted by node id.  large graphs are walked a
+    // level at a time and sorted with up to threads threads (0 for one
+    // per cpu).
+    class SnapshotIndex
+    {
+      public:
+        SnapshotIndex(const Graph & graph, const Filter * filter = NULL,
+                      unsigned int threads = 1);
+
+        const std::vector<Entry> & entries() const { return sorted; }
+        const Graph & graph() const { return g; }
+
+        // the nodes a diff reports, all of the graph unless it's filtered
+        int nodes() const {
+            return filter ? (int) sorted.size() : (int) g.nodeCount();
+        }
+
+        // sum of the self size of all reachable nodes
+        int64_t size() const { return totalSize; }
+
+      private:
+        void traverse();
+        void depthFirst(uint32_t root);
+        // a level at a time, split across at most parts threads
+        void byLevel(uint32_t root, unsigned int parts);
+
+        const Graph & g;
+        const Filter * filter;
+        unsigned int threads;
+        std::vector<Entry> sorted;
+        int64_t totalSize;
+    };
+
+    // a linear merge of two indexes.  the positions of nodes present only
+    // in a are appended to onlyA, those present only in b to onlyB.
+    void diff(const SnapshotIndex & a, const SnapshotIndex & b,
+              std::vector<uint32_t> & onlyA, std::vector<uint32_t> & onlyB);
+};
+
+#endif
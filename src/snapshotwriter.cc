@@ -0,0 +1,502 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#include "snapshotwriter.hh"
+#include "heapdiff.hh"
+#include "instance.hh"
+#include "snapshotcopy.hh"
+#include "snapshotfile.hh"
+
+#include <node.h>
+#include <v8-profiler.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include <fcntl.h>  // O_WRONLY etc
+#include <string.h> // memcpy()
+#include <time.h>   // time()
+
+using namespace v8;
+using namespace node;
+
+// how much JSON we ask V8 for at a time
+static const int CHUNK_SIZE = 64 * 1024;
+// the size of each buffer handed to the thread pool to be written
+static const size_t BUFFER_SIZE = 256 * 1024;
+// buffers in flight at once, serialization waits on the disk beyond this.
+// V8 serializes on the main thread in one go, so the loop is held for the
+// whole of it whatever we do; the choice is between holding it a little
+// longer when the disk is slow and buffering the whole snapshot, and we
+// keep memory bounded.  a writer owns MAX_IN_FLIGHT + 1 buffers for good:
+// the one being filled, and the rest handed back by the thread pool as
+// each write finishes, since WriteAfter can't run until serializing is done
+static const unsigned int MAX_IN_FLIGHT = 8;
+
+namespace {
+
+class SnapshotWriter;
+
+struct WriteReq {
+    uv_work_t req;
+    SnapshotWriter * writer;
+    char * data;
+    size_t len;
+    int64_t offset;
+    int errorno;
+};
+
+// a v8::OutputStream which never materializes the serialized snapshot.
+// V8 hands us JSON in chunks, we (optionally) deflate them into a
+// fixed size buffer, and each full buffer is written from the thread
+// pool through libuv's fs layer.
+class SnapshotWriter : public OutputStream
+{
+  public:
+    SnapshotWriter(uv_loop_t * loop, const char * path, bool gzip,
+                   Handle<Function> cb);
+    ~SnapshotWriter();
+
+    // false if zlib can't be set up
+    bool Init();
+    void Start();
+
+    // OutputStream
+    void EndOfStream();
+    int GetChunkSize() { return CHUNK_SIZE; }
+    WriteResult WriteAsciiChunk(char * data, int size);
+
+  private:
+    static void OnOpen(uv_fs_t * req);
+    static void WriteWork(uv_work_t * req);
+    static void WriteAfter(uv_work_t * req);
+    static void OnClose(uv_fs_t * req);
+
+    void Append(const char * data, size_t len);
+    void Deflate(const char * data, size_t len, int flush);
+    void Flush();
+    void FinishIfDone();
+    // true, noting the error, once a write on the thread pool has failed
+    bool WriteFailed();
+
+    std::string path;
+    bool gzip;
+    bool zinit;
+    z_stream zs;
+    Persistent<Function> cb;
+
+    // the isolate's loop, where opening, writing and closing are driven from
+    uv_loop_t * loop;
+    uv_fs_t fsReq;
+    uv_file fd;
+    uv_sem_t slots;
+    // buffers written and ready for reuse, filled from the thread pool.
+    // slots counts them
+    std::vector<char *> spare;
+    uv_mutex_t spareLock;
+
+    // synchronous fs calls register themselves with a loop, so the thread
+    // pool writes through a private one rather than racing the default
+    uv_loop_t * ioLoop;
+    uv_mutex_t ioLock;
+
+    // the first failed write's error, set on the thread pool as it
+    // happens so serialization stops without waiting for WriteAfter
+    uv_mutex_t errorLock;
+    int writeErrno;
+
+    char * buf;
+    size_t used;
+    int64_t offset;
+    unsigned int pending;
+    bool ended;
+    bool closing;
+    int errorno;
+    const char * syscall;
+};
+
+}
+
+SnapshotWriter::SnapshotWriter(uv_loop_t * loop, const char * path, bool gzip,
+                               Handle<Function> cb)
+    : path(path), gzip(gzip), zinit(false), loop(loop), fd(-1), writeErrno(0),
+      buf(new char[BUFFER_SIZE]), used(0), offset(0), pending(0),
+      ended(false), closing(false), errorno(0), syscall(NULL)
+{
+    this->cb = Persistent<Function>::New(cb);
+    fsReq.data = this;
+    uv_sem_init(&slots, MAX_IN_FLIGHT);
+    uv_mutex_init(&spareLock);
+    for (unsigned int i = 0; i < MAX_IN_FLIGHT; i++) {
+        spare.push_back(new char[BUFFER_SIZE]);
+    }
+    ioLoop = uv_loop_new();
+    uv_mutex_init(&ioLock);
+    uv_mutex_init(&errorLock);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (zinit) deflateEnd(&zs);
+    uv_sem_destroy(&slots);
+    // every write is done by now, so every buffer is back
+    for (size_t i = 0; i < spare.size(); i++) delete [] spare[i];
+    uv_mutex_destroy(&spareLock);
+    uv_mutex_destroy(&ioLock);
+    uv_mutex_destroy(&errorLock);
+    uv_loop_delete(ioLoop);
+    delete [] buf;
+    cb.Dispose();
+}
+
+bool
+SnapshotWriter::Init()
+{
+    if (!gzip) return true;
+
+    memset(&zs, 0, sizeof(zs));
+    // 16 + MAX_WBITS asks zlib for a gzip header and trailer
+    zinit = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+                         8, Z_DEFAULT_STRATEGY) == Z_OK;
+    return zinit;
+}
+
+void
+SnapshotWriter::Start()
+{
+    uv_fs_open(loop, &fsReq, path.c_str(),
+               O_WRONLY | O_CREAT | O_TRUNC, 0644, OnOpen);
+}
+
+void
+SnapshotWriter::OnOpen(uv_fs_t * req)
+{
+    SnapshotWriter * self = (SnapshotWriter *) req->data;
+
+    if (req->result < 0) {
+        self->errorno = req->errorno;
+        self->syscall = "open";
+        uv_fs_req_cleanup(req);
+        // nothing to close, report straight away
+        self->closing = true;
+        OnClose(req);
+        return;
+    }
+
+    self->fd = req->result;
+    uv_fs_req_cleanup(req);
+
+    HandleScope scope;
+    const HeapSnapshot * snapshot = heapdiff::HeapDiff::TakeSnapshot();
+    snapshot->Serialize(self, HeapSnapshot::kJSON);
+    ((HeapSnapshot *) snapshot)->Delete();
+
+    // an aborted stream never sees EndOfStream(), either way it's over
+    self->ended = true;
+    self->WriteFailed();
+    self->FinishIfDone();
+}
+
+bool
+SnapshotWriter::WriteFailed()
+{
+    if (errorno) return true;
+
+    uv_mutex_lock(&errorLock);
+    int e = writeErrno;
+    uv_mutex_unlock(&errorLock);
+
+    if (e) {
+        errorno = e;
+        syscall = "write";
+    }
+    return e != 0;
+}
+
+OutputStream::WriteResult
+SnapshotWriter::WriteAsciiChunk(char * data, int size)
+{
+    if (WriteFailed()) return kAbort;
+
+    if (gzip) Deflate(data, size, Z_NO_FLUSH);
+    else Append(data, size);
+
+    return kContinue;
+}
+
+void
+SnapshotWriter::EndOfStream()
+{
+    if (gzip) Deflate(NULL, 0, Z_FINISH);
+    Flush();
+}
+
+void
+SnapshotWriter::Append(const char * data, size_t len)
+{
+    while (len) {
+        size_t n = BUFFER_SIZE - used;
+        if (n > len) n = len;
+        memcpy(buf + used, data, n);
+        used += n;
+        data += n;
+        len -= n;
+        if (used == BUFFER_SIZE) Flush();
+    }
+}
+
+void
+SnapshotWriter::Deflate(const char * data, size_t len, int flush)
+{
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = len;
+
+    for (;;) {
+        zs.next_out = (Bytef *) (buf + used);
+        zs.avail_out = BUFFER_SIZE - used;
+        int r = deflate(&zs, flush);
+        used = BUFFER_SIZE - zs.avail_out;
+
+        if (used == BUFFER_SIZE) {
+            Flush();
+            continue;
+        }
+        if (flush == Z_FINISH ? r == Z_STREAM_END : zs.avail_in == 0) break;
+    }
+}
+
+// hand the current buffer off to the thread pool and carry on in a spare
+// one, waiting first for a write to finish if none is spare (see
+// MAX_IN_FLIGHT).  once a write has failed what's left is thrown away
+void
+SnapshotWriter::Flush()
+{
+    if (!used) return;
+    if (WriteFailed()) {
+        used = 0;
+        return;
+    }
+
+    uv_sem_wait(&slots);
+
+    WriteReq * w = new WriteReq;
+    w->writer = this;
+    w->data = buf;
+    w->len = used;
+    w->offset = offset;
+    w->errorno = 0;
+    w->req.data = w;
+
+    offset += used;
+    pending++;
+    uv_mutex_lock(&spareLock);
+    buf = spare.back();
+    spare.pop_back();
+    uv_mutex_unlock(&spareLock);
+    used = 0;
+
+    uv_queue_work(loop, &(w->req), WriteWork,
+                  (uv_after_work_cb) WriteAfter);
+}
+
+// runs on the thread pool, a synchronous libuv write at a fixed offset so
+// the order buffers are written in doesn't matter
+void
+SnapshotWriter::WriteWork(uv_work_t * req)
+{
+    WriteReq * w = (WriteReq *) req->data;
+    SnapshotWriter * self = w->writer;
+    size_t done = 0;
+
+    uv_mutex_lock(&(self->ioLock));
+    while (done < w->len) {
+        uv_fs_t fs;
+        int r = uv_fs_write(self->ioLoop, &fs, self->fd, w->data + done,
+                            w->len - done, w->offset + done, NULL);
+        if (r < 0) w->errorno = fs.errorno;
+        uv_fs_req_cleanup(&fs);
+        if (r <= 0) {
+            if (!w->errorno) w->errorno = UV_EIO;
+            break;
+        }
+        done += r;
+    }
+    uv_mutex_unlock(&(self->ioLock));
+
+    if (w->errorno) {
+        uv_mutex_lock(&(self->errorLock));
+        if (!self->writeErrno) self->writeErrno = w->errorno;
+        uv_mutex_unlock(&(self->errorLock));
+    }
+
+    // the buffer's free as soon as it's written, not once WriteAfter runs
+    uv_mutex_lock(&(self->spareLock));
+    self->spare.push_back(w->data);
+    w->data = NULL;
+    uv_mutex_unlock(&(self->spareLock));
+
+    uv_sem_post(&(self->slots));
+}
+
+void
+SnapshotWriter::WriteAfter(uv_work_t * req)
+{
+    WriteReq * w = (WriteReq *) req->data;
+    SnapshotWriter * self = w->writer;
+
+    if (w->errorno && !self->errorno) {
+        self->errorno = w->errorno;
+        self->syscall = "write";
+    }
+    self->pending--;
+    delete w;
+
+    self->FinishIfDone();
+}
+
+void
+SnapshotWriter::FinishIfDone()
+{
+    if (closing || pending || !(ended || errorno)) return;
+
+    closing = true;
+    uv_fs_close(loop, &fsReq, fd, OnClose);
+}
+
+void
+SnapshotWriter::OnClose(uv_fs_t * req)
+{
+    HandleScope scope;
+    SnapshotWriter * self = (SnapshotWriter *) req->data;
+
+    uv_fs_req_cleanup(req);
+
+    Handle<Value> argv[2];
+    if (self->errorno) {
+        argv[0] = UVException(self->errorno, self->syscall, NULL,
+                              self->path.c_str());
+        argv[1] = Undefined();
+    } else {
+        argv[0] = Null();
+        argv[1] = Number::New((double) self->offset);
+    }
+
+    Persistent<Function> cb = self->cb;
+    self->cb = Persistent<Function>();
+    delete self;
+
+    TryCatch try_catch;
+    cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    cb.Dispose();
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+}
+
+Handle<Value>
+snapshotwriter::write_snapshot(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 3 || !args[0]->IsString() || !args[2]->IsFunction()) {
+        return ThrowException(
+            Exception::TypeError(
+                String::New("write_snapshot(path, gzip, cb) requires a path and a callback")));
+    }
+
+    memwatch::Instance * instance = memwatch::Instance::current();
+    if (!instance) return memwatch::Instance::missing();
+    if (!instance->loop) return memwatch::Instance::offLoop("writeSnapshot");
+
+    String::Utf8Value path(args[0]);
+    SnapshotWriter * writer =
+        new SnapshotWriter(instance->loop, *path, args[1]->BooleanValue(),
+                           Handle<Function>::Cast(args[2]));
+    if (!writer->Init()) {
+        delete writer;
+        return ThrowException(Exception::Error(String::New("can't start gzip")));
+    }
+    writer->Start();
+
+    return scope.Close(Undefined());
+}
+
+// the binary format is written from a plain copy of the graph, so the
+// snapshot can go as soon as it's copied and the whole file is written
+// from the thread pool
+struct BinaryJob {
+    uv_work_t req;
+    Persistent<Function> cb;
+    std::string path;
+    time_t time;
+    snapshotindex::NameTable names;
+    snapshotindex::Graph graph;
+    uint64_t bytes;
+    bool ok;
+    std::string err;
+};
+
+static void AsyncBinaryWork(uv_work_t * req)
+{
+    BinaryJob * job = (BinaryJob *) req->data;
+    job->ok = snapshotfile::write(job->path.c_str(), job->graph, job->names,
+                                  job->time, job->bytes, job->err);
+}
+
+static void AsyncBinaryAfter(uv_work_t * req)
+{
+    HandleScope scope;
+    BinaryJob * job = (BinaryJob *) req->data;
+
+    Handle<Value> argv[2];
+    if (job->ok) {
+        argv[0] = Null();
+        argv[1] = Number::New((double) job->bytes);
+    } else {
+        argv[0] = Exception::Error(String::New(job->err.c_str()));
+        argv[1] = Undefined();
+    }
+
+    TryCatch try_catch;
+    job->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    job->cb.Dispose();
+    delete job;
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+}
+
+Handle<Value>
+snapshotwriter::write_binary_snapshot(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 2 || !args[0]->IsString() || !args[1]->IsFunction()) {
+        return ThrowException(
+            Exception::TypeError(
+                String::New("write_binary_snapshot(path, cb) requires a path and a callback")));
+    }
+
+    memwatch::Instance * instance = memwatch::Instance::current();
+    if (!instance) return memwatch::Instance::missing();
+    if (!instance->loop) return memwatch::Instance::offLoop("writeSnapshot");
+
+    BinaryJob * job = new BinaryJob;
+    job->path = *String::Utf8Value(args[0]);
+    job->cb = Persistent<Function>::New(Handle<Function>::Cast(args[1]));
+    job->time = time(NULL);
+    job->req.data = job;
+
+    const HeapSnapshot * snapshot = heapdiff::HeapDiff::TakeSnapshot();
+    snapshotindex::copySnapshot(snapshot, job->names, job->graph);
+    ((HeapSnapshot *) snapshot)->Delete();
+
+    uv_queue_work(instance->loop, &(job->req), AsyncBinaryWork,
+                  (uv_after_work_cb) AsyncBinaryAfter);
+
+    return scope.Close(Undefined());
+}
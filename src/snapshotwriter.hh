@@ -0,0 +1,22 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+#ifndef __SNAPSHOTWRITER_HH
+#define __SNAPSHOTWRITER_HH
+
+#include <node.h>
+
+namespace snapshotwriter
+{
+    // write_snapshot(path, gzip, cb): stream a heap snapshot in the
+    // .heapsnapshot format devtools reads to path, calling cb(err, bytes)
+    // once it's on disk
+    v8::Handle<v8::Value> write_snapshot(const v8::Arguments& args);
+
+    // write_binary_snapshot(path, cb): the same, in memwatch's compact
+    // binary format (see snapshotfile.hh)
+    v8::Handle<v8::Value> write_binary_snapshot(const v8::Arguments& args);
+};
+
+#endif
@@ -7,16 +7,16 @@
 
 #include <sstream>
 
-#include <stdlib.h> // abs()
-
 std::string
-mw_util::niceSize(int bytes) 
+mw_util::niceSize(int64_t bytes) 
 {
     std::stringstream ss;
+    // no llabs() in c++98
+    int64_t magnitude = bytes < 0 ? -bytes : bytes;
     
-    if (abs(bytes) > 1024 * 1024) {
+    if (magnitude > 1024 * 1024) {
         ss << ROUND(bytes / (((double) 1024 * 1024 ) / 100)) / (double) 100 << " mb";
-    } else if (abs(bytes) > 1024) {
+    } else if (magnitude > 1024) {
         ss << ROUND(bytes / (((double) 1024 ) / 100)) / (double) 100 << " kb";
     } else {
         ss << bytes << " bytes";
@@ -26,7 +26,7 @@ mw_util::niceSize(int bytes)
 }
 
 std::string
-mw_util::niceDelta(int seconds) 
+mw_util::niceDelta(int64_t seconds) 
 {
     std::stringstream ss;
 
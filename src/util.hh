@@ -4,13 +4,15 @@
 
 #include <string>
 
+#include <stdint.h>
+
 namespace mw_util {
     // given a size in bytes, return a human readable representation of the
     // string
-    std::string niceSize(int bytes);
+    std::string niceSize(int64_t bytes);
 
     // given a delta in seconds, return a human redable representation
-    std::string niceDelta(int seconds);
+    std::string niceDelta(int64_t seconds);
 };
 
 
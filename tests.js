@@ -5,10 +5,19 @@ memwatch = require('./');
 describe('the library', function() {
   it('should export a couple functions', function(done) {
     should.exist(memwatch.gc);
+    should.exist(memwatch.gcStats);
+    should.exist(memwatch.heapStats);
+    should.exist(memwatch.processStats);
+    should.exist(memwatch.configureLeakDetector);
+    should.exist(memwatch.configureStats);
+    should.exist(memwatch.setSampling);
+    should.exist(memwatch.census);
+    should.exist(memwatch.setCensusInterval);
     should.exist(memwatch.on);
     should.exist(memwatch.once);
     should.exist(memwatch.removeAllListeners);
     should.exist(memwatch.HeapDiff);
+    should.exist(memwatch.HeapDiffSession);
     done();
   });
 });
@@ -22,6 +31,200 @@ describe('calling .gc()', function() {
   });
 });
 
+describe('gcStats()', function() {
+  it('should time full GCs', function(done) {
+    memwatch.gc();
+    var s = memwatch.gcStats();
+    (s.mark_sweep.count > 0).should.be.ok;
+    (s.mark_sweep.max_ms >= s.mark_sweep.p50_ms).should.be.ok;
+    s.scavenge.should.be.a('object');
+    done();
+  });
+});
+
+describe('heapStats()', function() {
+  it('should describe the heap after a compaction', function(done) {
+    memwatch.once('stats', function(s) {
+      var h = memwatch.heapStats();
+      (h.used > 0).should.be.ok;
+      (h.total >= h.used).should.be.ok;
+      h.unused.should.equal(h.total - h.used);
+      (h.rss >= 0).should.be.ok;
+      (h.malloc >= 0).should.be.ok;
+      h.trend.should.be.a('object');
+      s.heap.should.be.a('object');
+      done();
+    });
+    memwatch.gc();
+  });
+});
+
+describe('processStats()', function() {
+  it('should count this isolate after a compaction', function(done) {
+    memwatch.once('stats', function(s) {
+      var p = memwatch.processStats();
+      (p.isolates >= 1).should.be.ok;
+      (p.used > 0).should.be.ok;
+      (p.total >= p.used).should.be.ok;
+      done();
+    });
+    memwatch.gc();
+  });
+});
+
+describe('configureLeakDetector()', function() {
+  it('should take an options object', function(done) {
+    (function() { memwatch.configureLeakDetector(0.99); }).should.throw();
+    memwatch.configureLeakDetector({ confidence: 0.99, window: 60 });
+    memwatch.configureLeakDetector({ native: false });
+    memwatch.configureLeakDetector({ native: true });
+    done();
+  });
+
+  it('should reject probabilities outside of 0 to 1', function(done) {
+    [ 'confidence', 'alpha', 'beta' ].forEach(function(name) {
+      [ 0, 1, -0.5, 1.5 ].forEach(function(value) {
+        var o = {};
+        o[name] = value;
+        (function() { memwatch.configureLeakDetector(o); }).should.throw();
+      });
+    });
+    memwatch.configureLeakDetector({ confidence: 0.99, alpha: 0.3, beta: 0.1 });
+    done();
+  });
+});
+
+describe('leak detection', function() {
+  // heap sizes for n compactions, shaped by f and blurred by gaussian
+  // noise of the given spread.  park-miller, so every run sees the same
+  function heap(n, spread, f) {
+    var seed = 1, sizes = [];
+    function uniform() {
+      seed = seed * 16807 % 2147483647;
+      return seed / 2147483647;
+    }
+    for (var i = 0; i < n; i++) {
+      var u = uniform(), v = uniform();
+      var noise = Math.sqrt(-2 * Math.log(u)) * Math.cos(2 * Math.PI * v);
+      sizes.push(50e6 + f(i) + noise * spread);
+    }
+    return sizes;
+  }
+
+  it('should call a steady leak', function(done) {
+    var leaks = memwatch._simulateLeakDetector(
+      heap(200, 1e5, function(i) { return i * 20000; }));
+    (leaks.length > 0).should.be.ok;
+    (leaks[0] < 60).should.be.ok;
+    done();
+  });
+
+  it('should stay quiet over a flat, noisy heap', function(done) {
+    memwatch._simulateLeakDetector(
+      heap(2000, 1e6, function() { return 0; })).should.eql([]);
+    done();
+  });
+
+  it('should stay quiet once a warm-up levels off', function(done) {
+    // a cache filling up, all but done by the 50th compaction
+    var leaks = memwatch._simulateLeakDetector(
+      heap(2000, 1e6, function(i) { return 20e6 * (1 - Math.exp(-i / 10)); }));
+    leaks.filter(function(i) { return i >= 100; }).should.eql([]);
+    done();
+  });
+
+  it('should take the same options', function(done) {
+    (function() {
+      memwatch._simulateLeakDetector([], { confidence: 1 });
+    }).should.throw();
+    // nothing is called during warm-up
+    memwatch._simulateLeakDetector(
+      heap(200, 1e5, function(i) { return i * 20000; }),
+      { warmup: 200 }).should.eql([]);
+    done();
+  });
+});
+
+describe('configureStats()', function() {
+  it('should report how many compactions an event covers', function(done) {
+    (function() { memwatch.configureStats(1000); }).should.throw();
+    memwatch.configureStats({ interval: 0, minDelta: 0 });
+    memwatch.once('stats', function(s) {
+      (s.compactions_since_last >= 1).should.be.ok;
+      (s.min_since_last <= s.max_since_last).should.be.ok;
+      s.dropped_since_last.should.equal(0);
+      done();
+    });
+    memwatch.gc();
+  });
+});
+
+describe('setSampling()', function() {
+  it('should take a number of compactions', function(done) {
+    (function() { memwatch.setSampling('often'); }).should.throw();
+    memwatch.setSampling(1);
+    memwatch.gc();
+    memwatch.setSampling(0);
+    done();
+  });
+
+  it('should name what grew in leak reports', function(done) {
+    this.timeout(30000);
+    function SampledLeak() {};
+    var held = [], reported = false;
+
+    memwatch.setSampling(1);
+    memwatch.configureLeakDetector({ warmup: 0, minSamples: 5, confirm: 1,
+                                     confidence: 0.9, native: false });
+    memwatch.on('leak', function onLeak(info) {
+      // the first report can come before there's a census to compare with
+      if (info.kind !== 'heap' || !info.growing) return;
+      memwatch.removeListener('leak', onLeak);
+      reported = true;
+      memwatch.setSampling(0);
+      memwatch.configureLeakDetector({ warmup: 10, minSamples: 10, confirm: 10,
+                                       confidence: 0.99, native: true });
+      var grew = info.growing.map(function(t) { return t.what; });
+      (grew.indexOf('SampledLeak') >= 0).should.be.ok;
+      done();
+    });
+
+    (function grow() {
+      if (reported) return;
+      for (var i = 0; i < 1000; i++) held.push(new SampledLeak());
+      memwatch.gc();
+      setTimeout(grow, 1);
+    })();
+  });
+});
+
+describe('census()', function() {
+  it('should count live objects by type', function(done) {
+    function CensusClass() {};
+    var arr = [];
+    for (var i = 0; i < 100; i++) arr.push(new CensusClass());
+    var c = memwatch.census();
+    (c.nodes > 0).should.be.ok;
+    var counted;
+    c.types.forEach(function(t) {
+      if (t.what === 'CensusClass') counted = t;
+    });
+    should.exist(counted);
+    (counted.count >= 100).should.be.ok;
+    done();
+  });
+
+  it('should emit census events on an interval', function(done) {
+    (function() { memwatch.setCensusInterval('often'); }).should.throw();
+    memwatch.once('census', function(c) {
+      memwatch.setCensusInterval(0);
+      c.types.should.be.an.instanceOf(Array);
+      done();
+    });
+    memwatch.setCensusInterval(10);
+  });
+});
+
 describe('HeapDiff', function() {
   it('should detect allocations', function(done) {
     function LeakingClass() {};
@@ -44,6 +247,246 @@ describe('HeapDiff', function() {
   });
 });
 
+describe('HeapDiff', function() {
+  it('should detect allocations when ended asynchronously', function(done) {
+    function AsyncLeakingClass() {};
+    var arr = [];
+    var hd = new memwatch.HeapDiff();
+    for (var i = 0; i < 100; i++) arr.push(new AsyncLeakingClass());
+    hd.endAsync(function(err, diff) {
+      should.not.exist(err);
+      var leakingReport;
+      diff.change.details.forEach(function(d) {
+        if (d.what === 'AsyncLeakingClass')
+          leakingReport = d;
+      });
+      should.exist(leakingReport);
+      ((leakingReport['+'] - leakingReport['-']) > 0).should.be.ok;
+      (function() { hd.end(); }).should.throw();
+      done();
+    });
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should report retained sizes when asked', function(done) {
+    function RetainingClass() { this.payload = []; };
+    var arr = [];
+    var hd = new memwatch.HeapDiff({ retained: true, examples: 3 });
+    for (var i = 0; i < 100; i++) arr.push(new RetainingClass());
+    var diff = hd.end();
+    var report;
+    diff.change.details.forEach(function(d) {
+      if (d.what === 'RetainingClass')
+        report = d;
+    });
+    should.exist(report);
+    (report.retained_size_bytes >= report.size_bytes).should.be.ok;
+    report.examples.should.be.an.instanceOf(Array);
+    (report.examples.length <= 3).should.be.ok;
+    done();
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should detect allocations with object tracking', function(done) {
+    function TrackedClass() {};
+    var arr = [];
+    var hd = new memwatch.HeapDiff({ tracking: true });
+    for (var i = 0; i < 100; i++) arr.push(new TrackedClass());
+    var diff = hd.end();
+    var report;
+    diff.change.details.forEach(function(d) {
+      if (d.what === 'TrackedClass')
+        report = d;
+    });
+    should.exist(report);
+    (report['+'] >= 100).should.be.ok;
+    report['-'].should.equal(0);
+    done();
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should find retainer paths to new instances', function(done) {
+    function RetainedClass() {};
+    var holder = { retained: [] };
+    var hd = new memwatch.HeapDiff({ paths: 5 });
+    for (var i = 0; i < 1000; i++) holder.retained.push(new RetainedClass());
+    var diff = hd.end();
+    var report;
+    diff.change.details.forEach(function(d) {
+      if (d.what === 'RetainedClass')
+        report = d;
+    });
+    should.exist(report);
+    report.paths.should.be.an.instanceOf(Array);
+    (report.paths.length > 0).should.be.ok;
+    var path = report.paths[0];
+    path[path.length - 1].what.should.equal('RetainedClass');
+    done();
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should report each type once', function(done) {
+    var arr = [];
+    var hd = new memwatch.HeapDiff();
+    // arrays, and the engine's own arrays and strings, share their names
+    for (var i = 0; i < 100; i++) arr.push([i], new String('s' + i), new Number(i));
+    var diff = hd.end();
+    var seen = {};
+    diff.change.details.forEach(function(d) {
+      should.not.exist(seen[d.what]);
+      seen[d.what] = true;
+    });
+    should.exist(seen.Array);
+    var census = memwatch.census(), counted = {};
+    census.types.forEach(function(t) {
+      should.not.exist(counted[t.what]);
+      counted[t.what] = true;
+    });
+    done();
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should keep type ids from one diff to the next', function(done) {
+    function StableClass() {};
+    var arr = [];
+    function typeId(diff) {
+      var id;
+      diff.change.details.forEach(function(d) {
+        if (d.what === 'StableClass') id = d.type_id;
+      });
+      return id;
+    }
+    var hd = new memwatch.HeapDiff();
+    for (var i = 0; i < 10; i++) arr.push(new StableClass());
+    var first = typeId(hd.end());
+    hd = new memwatch.HeapDiff();
+    for (var i = 0; i < 10; i++) arr.push(new StableClass());
+    var second = typeId(hd.end());
+    should.exist(first);
+    first.should.equal(second);
+    done();
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should diff the same on any number of threads', function(done) {
+    function ThreadedClass() {};
+    var arr = [];
+    var one = new memwatch.HeapDiff({ threads: 1 });
+    var many = new memwatch.HeapDiff({ threads: 4 });
+    for (var i = 0; i < 100; i++) arr.push(new ThreadedClass());
+    var a = one.end(), b = many.end();
+    function added(diff) {
+      var n = 0;
+      diff.change.details.forEach(function(d) {
+        if (d.what === 'ThreadedClass') n = d['+'];
+      });
+      return n;
+    }
+    added(a).should.equal(100);
+    added(b).should.equal(100);
+    done();
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should diff the same when the work is split', function(done) {
+    function SplitClass() {};
+    // small enough parts that this heap is walked, sorted and merged
+    // in pieces, even on one cpu
+    memwatch._forceParallel(16);
+    try {
+      var arr = [];
+      for (var i = 0; i < 100; i++) arr.push(new SplitClass());
+      var one = new memwatch.HeapDiff({ threads: 1 });
+      var many = new memwatch.HeapDiff({ threads: 4 });
+      // everything it matches is freed, so the later side is empty
+      var filtered = new memwatch.HeapDiff({ threads: 4, name: 'SplitClass' });
+      arr = null;
+      var a = one.end(), b = many.end(), c = filtered.end();
+    } finally {
+      memwatch._forceParallel(0);
+    }
+    function released(diff) {
+      var n = 0;
+      diff.change.details.forEach(function(d) {
+        if (d.what === 'SplitClass') n = d['-'];
+      });
+      return n;
+    }
+    released(a).should.equal(100);
+    released(b).should.equal(100);
+    released(c).should.equal(100);
+    c.change.details.length.should.equal(1);
+    done();
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should group duplicated strings', function(done) {
+    var arr = [];
+    var hd = new memwatch.HeapDiff({ strings: 3 });
+    for (var i = 0; i < 100; i++) arr.push(['duplicated', 'header'].join(' '));
+    var diff = hd.end();
+    diff.change.strings.should.be.an.instanceOf(Array);
+    var group;
+    diff.change.strings.forEach(function(s) {
+      if (s.value === 'duplicated header')
+        group = s;
+    });
+    should.exist(group);
+    (group.count >= 100).should.be.ok;
+    (group.wasted_bytes < group.size_bytes).should.be.ok;
+    done();
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should diff against a baseline spilled to disk', function(done) {
+    function SpilledClass() {};
+    var arr = [];
+    var hd = new memwatch.HeapDiff({ spill: true });
+    for (var i = 0; i < 100; i++) arr.push(new SpilledClass());
+    var diff = hd.end();
+    var report;
+    diff.change.details.forEach(function(d) {
+      if (d.what === 'SpilledClass')
+        report = d;
+    });
+    should.exist(report);
+    ((report['+'] - report['-']) > 0).should.be.ok;
+    (diff.before.nodes > 0).should.be.ok;
+    done();
+  });
+});
+
+describe('HeapDiff', function() {
+  it('should diff only what the filter lets through', function(done) {
+    function FilteredKeep() {};
+    function FilteredSkip() {};
+    var holder = { keep: [], skip: [] };
+    var outside = [];
+    var hd = new memwatch.HeapDiff({ name: 'FilteredK*', root: holder });
+    for (var i = 0; i < 100; i++) {
+      holder.keep.push(new FilteredKeep());
+      holder.skip.push(new FilteredSkip());
+      // passes the name filter, but isn't under the root
+      outside.push(new FilteredKeep());
+    }
+    var diff = hd.end();
+    diff.change.details.length.should.equal(1);
+    diff.change.details[0].what.should.equal('FilteredKeep');
+    diff.change.details[0]['+'].should.equal(100);
+    outside.length.should.equal(100);
+    done();
+  });
+});
+
 describe('HeapDiff', function() {
   it('double end should throw', function(done) {
     var hd = new memwatch.HeapDiff();
@@ -54,6 +497,160 @@ describe('HeapDiff', function() {
   });
 });
 
+describe('HeapDiffSession', function() {
+  it('should diff each checkpoint against the last', function(done) {
+    function SessionLeak() {};
+    var arr = [];
+    var session = new memwatch.HeapDiffSession();
+    function leaked(diff) {
+      var n = 0;
+      diff.change.details.forEach(function(d) {
+        if (d.what === 'SessionLeak') n = d['+'] - d['-'];
+      });
+      return n;
+    }
+    for (var i = 0; i < 100; i++) arr.push(new SessionLeak());
+    leaked(session.checkpoint()).should.equal(100);
+    for (var i = 0; i < 50; i++) arr.push(new SessionLeak());
+    session.checkpointAsync(function(err, diff) {
+      should.not.exist(err);
+      leaked(diff).should.equal(50);
+      done();
+    });
+  });
+});
+
+describe('writeSnapshot', function() {
+  it('should write a heap snapshot to disk', function(done) {
+    var fs = require('fs'),
+    path = __dirname + '/memwatch-test-' + process.pid + '.heapsnapshot';
+    memwatch.writeSnapshot(path, function(err, bytes) {
+      should.not.exist(err);
+      (bytes > 0).should.be.ok;
+      fs.statSync(path).size.should.equal(bytes);
+      JSON.parse(fs.readFileSync(path, 'utf8')).should.have.property('snapshot');
+      fs.unlinkSync(path);
+      done();
+    });
+  });
+
+  it('should gzip a heap snapshot', function(done) {
+    var fs = require('fs'), zlib = require('zlib'),
+    path = __dirname + '/memwatch-test-' + process.pid + '.heapsnapshot.gz';
+    memwatch.writeSnapshot(path, { gzip: true }, function(err, bytes) {
+      should.not.exist(err);
+      fs.statSync(path).size.should.equal(bytes);
+      zlib.gunzip(fs.readFileSync(path), function(err, json) {
+        fs.unlinkSync(path);
+        should.not.exist(err);
+        JSON.parse(json.toString('utf8')).should.have.property('snapshot');
+        done();
+      });
+    });
+  });
+
+  it('should report a failed write', function(done) {
+    // opens fine, every write fails with ENOSPC
+    if (!require('fs').existsSync('/dev/full')) return done();
+    memwatch.writeSnapshot('/dev/full', function(err, bytes) {
+      should.exist(err);
+      err.code.should.equal('ENOSPC');
+      should.not.exist(bytes);
+      done();
+    });
+  });
+
+  it('should report a failed open', function(done) {
+    memwatch.writeSnapshot(__dirname + '/no/such/dir/x.heapsnapshot', function(err) {
+      should.exist(err);
+      err.code.should.equal('ENOENT');
+      done();
+    });
+  });
+
+  it('should write a binary snapshot to disk', function(done) {
+    var fs = require('fs'),
+    path = __dirname + '/memwatch-test-' + process.pid + '.snap';
+    memwatch.writeSnapshot(path, { binary: true }, function(err, bytes) {
+      should.not.exist(err);
+      (bytes > 0).should.be.ok;
+      fs.statSync(path).size.should.equal(bytes);
+      fs.unlinkSync(path);
+      done();
+    });
+  });
+
+  describe('read back by memwatch-diff', function() {
+    var fs = require('fs'),
+    execFile = require('child_process').execFile,
+    tool = __dirname + '/build/Release/memwatch-diff',
+    first = __dirname + '/memwatch-test-' + process.pid + '-first.snap',
+    second = __dirname + '/memwatch-test-' + process.pid + '-second.snap';
+
+    after(function() {
+      [ first, second ].forEach(function(path) {
+        if (fs.existsSync(path)) fs.unlinkSync(path);
+      });
+    });
+
+    function detail(details, what) {
+      var found;
+      details.forEach(function(d) { if (d.what === what) found = d; });
+      should.exist(found);
+      return found;
+    }
+
+    it('should diff the pair as HeapDiff does', function(done) {
+      function RoundTripLeak() {};
+      var held = [];
+      // the diff's snapshots are taken alongside the files'
+      var hd = new memwatch.HeapDiff();
+      memwatch.writeSnapshot(first, { binary: true }, function(err) {
+        should.not.exist(err);
+        for (var i = 0; i < 100; i++) held.push(new RoundTripLeak());
+        var diff = hd.end();
+        memwatch.writeSnapshot(second, { binary: true }, function(err) {
+          should.not.exist(err);
+          execFile(tool, [ first, second ], function(err, stdout) {
+            should.not.exist(err);
+            var out = JSON.parse(stdout);
+            var ours = detail(out.change.details, 'RoundTripLeak'),
+            theirs = detail(diff.change.details, 'RoundTripLeak');
+            ours['+'].should.equal(100);
+            ours['+'].should.equal(theirs['+']);
+            ours['-'].should.equal(theirs['-']);
+            ours.size_bytes.should.equal(theirs.size_bytes);
+            done();
+          });
+        });
+      });
+    });
+
+    it('should refuse a truncated file', function(done) {
+      fs.truncateSync(second, Math.floor(fs.statSync(second).size / 2));
+      execFile(tool, [ first, second ], function(err, stdout, stderr) {
+        should.exist(err);
+        err.code.should.equal(1);
+        stderr.should.match(/truncated or corrupt/);
+        done();
+      });
+    });
+
+    it('should refuse a corrupted file', function(done) {
+      var bytes = fs.readFileSync(first);
+      // the header survives, everything it describes doesn't
+      for (var i = 64; i < bytes.length; i++) bytes[i] = (i * 131) & 0xff;
+      fs.writeFileSync(second, bytes);
+      execFile(tool, [ first, second ], function(err, stdout, stderr) {
+        should.exist(err);
+        err.code.should.equal(1);
+        stderr.should.match(/truncated or corrupt/);
+        done();
+      });
+    });
+  });
+});
+
 describe('improper HeapDiff allocation', function() {
   it('should throw an exception', function(done) {
     // equivalent to "new require('memwatch').HeapDiff()"
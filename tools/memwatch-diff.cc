@@ -0,0 +1,133 @@
+/*
+ * 2012|lloyd|http://wtfpl.org
+ */
+
+// memwatch-diff: compare two snapshots written with
+// memwatch.writeSnapshot(path, { binary: true }), offline.  prints the
+// same report HeapDiff.end() returns, as JSON.
+
+#include "changeset.hh"
+#include "snapshotfile.hh"
+#include "util.hh"
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: memwatch-diff [--retained] [--examples n] [--threads n]\n"
+            "                     <before> <after>\n"
+            "\n"
+            "  --retained      compute retained sizes from the dominator tree\n"
+            "  --examples n    report the n largest new instances per type\n"
+            "  --threads n     walk and merge with at most n threads, 0 (the\n"
+            "                  default) for one per cpu\n");
+    exit(1);
+}
+
+static string quote(const char * s)
+{
+    string out("\"");
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+    return out;
+}
+
+static void printSummary(const char * name, const heapdiff::SnapshotSummary & s)
+{
+    printf("  %s: { \"nodes\": %d, \"time\": %ld, \"size_bytes\": %lld, \"size\": %s },\n",
+           quote(name).c_str(), s.nodes, (long) s.time, (long long) s.size,
+           quote(mw_util::niceSize(s.size).c_str()).c_str());
+}
+
+int main(int argc, char ** argv)
+{
+    heapdiff::DiffOptions options;
+    vector<const char *> files;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--retained")) {
+            options.retained = true;
+        } else if (!strcmp(argv[i], "--examples") && i + 1 < argc) {
+            options.examples = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            options.threads = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.size() != 2) usage();
+
+    snapshotindex::NameTable names;
+    snapshotindex::Graph before, after;
+    heapdiff::Comparison cmp;
+    string err;
+
+    if (!snapshotfile::read(files[0], names, before, cmp.before.time, err) ||
+        !snapshotfile::read(files[1], names, after, cmp.after.time, err))
+    {
+        fprintf(stderr, "memwatch-diff: %s\n", err.c_str());
+        return 1;
+    }
+
+    heapdiff::compare(before, after, names, options, cmp);
+
+    vector<uint32_t> keys;
+    heapdiff::reportOrder(cmp.changes, names, keys);
+
+    printf("{\n");
+    printSummary("before", cmp.before);
+    printSummary("after", cmp.after);
+    printf("  \"change\": { \"size_bytes\": %lld, \"size\": %s, "
+           "\"freed_nodes\": %lu, \"allocated_nodes\": %lu,\n"
+           "    \"details\": [",
+           (long long) cmp.sizeChange, quote(mw_util::niceSize(cmp.sizeChange).c_str()).c_str(),
+           (unsigned long) cmp.freedNodes, (unsigned long) cmp.allocatedNodes);
+
+    for (size_t j = 0; j < keys.size(); j++) {
+        const heapdiff::change & c = cmp.changes[keys[j]];
+        printf("%s\n      { \"what\": %s, \"size_bytes\": %lld, \"size\": %s, "
+               "\"+\": %lld, \"-\": %lld",
+               j ? "," : "", quote(heapdiff::typeKeyName(keys[j], names)).c_str(),
+               (long long) c.size, quote(mw_util::niceSize(c.size).c_str()).c_str(),
+               (long long) c.added, (long long) c.released);
+        if (options.retained && c.added) {
+            printf(", \"retained_size_bytes\": %lld, \"retained_size\": %s, \"examples\": [",
+                   (long long) c.retained, quote(mw_util::niceSize(c.retained).c_str()).c_str());
+            for (size_t e = 0; e < c.examples.size(); e++) {
+                const heapdiff::example & ex = c.examples[e];
+                printf("%s { \"what\": %s, \"size_bytes\": %lld, "
+                       "\"retained_size_bytes\": %lld, \"retainers\": %d }",
+                       e ? "," : "", quote(ex.name.c_str()).c_str(),
+                       (long long) ex.self_size, (long long) ex.retained_size,
+                       ex.retainers);
+            }
+            printf(" ]");
+        }
+        printf(" }");
+    }
+    printf("\n    ]\n  }\n}\n");
+
+    return 0;
+}